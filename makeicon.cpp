@@ -9,10 +9,50 @@
 #include <algorithm>
 #include <string>
 #include <vector>
+#include <map>
+#include <set>
+#include <random>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <tuple>
+#include <memory>
+#include <exception>
+#include <chrono>
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#define NOGDI
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+#include <errno.h>
+#endif
+#include <assert.h>
+#include <math.h>
+
+#include "makeicon.h"
 
 // We use the stb image libs for reading, resizing, and writing images for packing.
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
@@ -48,12 +88,32 @@ fprintf(stderr, "\n");                   \
 }                                        \
 while(0)
 
+// Failures while generating an icon are thrown rather than aborting, so the library can return them as an error
+// code. The command-line tool catches them and reports them the same way as ERROR.
+struct RunFailure
+{
+    MakeIconError error;
+    std::string   message;
+};
+
+[[noreturn]] static void fail_run(MakeIconError error, const char* format, ...)
+{
+    char message[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    throw RunFailure { error, message };
+}
+
+#define FAIL(error, ...) fail_run(error, __VA_ARGS__)
+
 #define CAST(t,x) ((t)(x))
 
 typedef  uint8_t  u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
-typedef uint32_t u64;
+typedef uint64_t u64;
 typedef   int8_t  s8;
 typedef  int16_t s16;
 typedef  int32_t s32;
@@ -73,18 +133,56 @@ enum Platform_
 
 static constexpr const char* PLATFORM_NAMES[Platform_COUNT] = { "win32", "osx", "ios", "android" };
 
+static constexpr s32 MAX_ICON_SIZE = 16384; // For the platforms whose formats don't limit the size.
+
+typedef s32 Compression;
+enum Compression_
+{
+    Compression_Fast,
+    Compression_Default,
+    Compression_Max,
+    Compression_COUNT
+};
+
+static constexpr const char* COMPRESSION_NAMES[Compression_COUNT] = { "fast", "default", "max" };
+
+typedef s32 IcoFormat;
+enum IcoFormat_
+{
+    IcoFormat_Png,
+    IcoFormat_Bmp,
+    IcoFormat_Auto,
+    IcoFormat_COUNT
+};
+
+static constexpr const char* ICO_FORMAT_NAMES[IcoFormat_COUNT] = { "png", "bmp", "auto" };
+
 static constexpr const char* MAKEICON_HELP_MESSAGE =
-"makeicon [-help] [-version] [-resize] [-platform:name] -sizes:x,y,z... -input:x,y,z... output\n"
+"makeicon [-help] [-version] [-resize] [-platform:name] [-jobs:n] [-compression:level] [-ico-format:format] [-update] [-watch] [-dry-run] [-stats] [-trace:file] [-manifest:file] [-serve:socket] [-client:socket] -sizes:x,y,z... -input:x,y,z... output\n"
 "\n"
 "    -sizes:...   [Required]  Comma-separated list of icon size(s) to be included in the generated output icon or a .json file to read sizes from on mac.\n"
 "    -input:...   [Required]  Comma-separated input image(s) and/or directories and/or .txt files containing file names to be used to generate the icon sizes.\n"
 "    -resize      [Optional]  Whether to allow resizing input images to match the requested output sizes, defaults to false.\n"
+"    -cascade     [Optional]  Resize each icon size from the next larger generated size instead of the input image, defaults to false.\n"
+"    -linear      [Optional]  Convert each input to premultiplied linear light once and resize every icon size from that, defaults to false.\n"
 "    -radius      [Optional]  Round the edges of the icon image by percentage of size, defaults to 0\n"
 "    -padding     [Optional]  Adds alpha padding around icon by percentage of size, defaults to 0\n"
 "    -platform    [Optional]  Platform to generate icons for. Options are win32, osx, ios, android. Defaults to win32.\n"
+"    -jobs        [Optional]  Number of worker threads used to resize and encode icon sizes, defaults to the number of cores.\n"
+"    -compression [Optional]  PNG compression level. Options are fast, default, max. Defaults to default.\n"
+"    -ico-format  [Optional]  How .ico entries are stored. Options are png, bmp, auto (bmp below 64 pixels and png from there up). Defaults to png.\n"
+"    -manifest    [Optional]  Runs every job listed in a file in one process, each line is a makeicon command line that can name several outputs.\n"
+"    -update      [Optional]  Only renders the .ico entries whose inputs or settings changed and copies the rest from the existing file.\n"
+"    -watch       [Optional]  Keeps running and regenerates the outputs that depend on an input whenever it changes, until interrupted.\n"
+"    -serve       [Optional]  Runs as a server on a Unix domain socket, generating icons for the command lines sent by -client until killed.\n"
+"    -client      [Optional]  Sends the rest of the command line to the server listening on the socket instead of running it here.\n"
+"    -cache       [Optional]  Directory to cache generated output in, runs with unchanged inputs and options are served from the cache.\n"
+"    -dry-run     [Optional]  Prints the plan of every output file, its size and the input it is rendered from without writing anything.\n"
+"    -stats       [Optional]  Prints how long each phase took along with the bytes and pixels it processed, and the compression of each size.\n"
+"    -trace       [Optional]  Writes a Chrome trace event JSON file with a span for every job and phase on every thread, view it in chrome://tracing.\n"
 "    -version     [Optional]  Prints out the current version number of the makeicon binary and exits.\n"
 "    -help        [Optional]  Prints out this help/usage message for the program and exits.\n"
-"     output      [Required]  The name of the icon that will be generated by the program.\n";
+"     output      [Required]  The name of the icon that will be generated by the program, on osx a name ending in .icns writes a single .icns file.\n";
 
 struct Argument
 {
@@ -96,20 +194,32 @@ struct Options
 {
     Platform                 platform = Platform_Win32;
     bool                     resize   = false;
+    bool                     cascade  = false;
+    bool                     linear   = false;
     std::vector<s32>         sizes;
     std::vector<std::string> input;
     std::string              contents;
     std::string              output;
     f32                      padding = 0.0f;
     f32                      radius = 0.0f;
+    s32                      jobs = 0; // 0 means use the number of hardware threads.
+    std::string              cache;
+    Compression              compression = Compression_Default;
+    IcoFormat                ico_format = IcoFormat_Png;
+    bool                     update = false;
+    bool                     stats = false;
+    std::string              trace;
+    bool                     dry_run = false;
 };
 
 struct Image
 {
-    s32 width  = 0;
-    s32 height = 0;
-    s32 bpp    = 0; // bytes per pixel
-    u8* data   = NULL;
+    s32       width        = 0;
+    s32       height       = 0;
+    s32       bpp          = 0; // bytes per pixel
+    u8*       data         = NULL;
+    const u8* encoded      = NULL; // For a streamed source, the PNG file that is decoded while resizing instead of data.
+    size_t    encoded_size = 0;
 
     inline bool operator<(const Image& rhs) const
     {
@@ -123,322 +233,5297 @@ static void free_image(Image& image)
     image.data = NULL;
 }
 
-struct PngImage
+//
+// Tracing
+//
+
+// With -stats or -trace every phase of the run is timed as a span along with the bytes and pixels it handled.
+// Spans are recorded to the trace of the current thread, which parallel_for passes on to the tasks it runs, so
+// when neither option is given the only cost of a span is checking that the pointer is null.
+struct TraceEvent
+{
+    const char* name      = NULL;
+    std::string detail;         // Optional label, such as the file being written.
+    u32         thread    = 0;
+    s64         start     = 0;  // Microseconds since the trace began.
+    s64         duration  = 0;
+    s32         size      = 0;  // Pixel size of the image the span worked on, if any.
+    u64         bytes_in  = 0;
+    u64         bytes_out = 0;
+    u64         pixels    = 0;
+};
+
+struct Trace
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::mutex                            mutex;
+    std::vector<TraceEvent>               events;
+    std::vector<std::thread::id>          threads; // The index of a thread is its id in the trace.
+};
+
+static thread_local Trace* current_trace = NULL;
+
+static s64 get_trace_time(const Trace& trace)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - trace.start).count();
+}
+
+// Records a span covering the lifetime of the scope, if the current thread has a trace. The counters of the event
+// can be filled in at any point before the scope ends.
+struct TraceScope
 {
-    explicit PngImage(const Image& image)
+    Trace*     trace;
+    TraceEvent event;
+
+    explicit TraceScope(const char* name): trace(current_trace)
     {
-        int mem_size = 0;
-        int stride_in_bytes = image.width * 4;
-        width = image.width;
-        height = image.height;
-        data = stbi_write_png_to_mem(image.data, stride_in_bytes, width, height, 4, &mem_size);
-        data_size = mem_size;
+        if(trace)
+        {
+            event.name = name;
+            event.start = get_trace_time(*trace);
+        }
     }
 
-    s32     width       = 0;
-    s32     height      = 0;
-    size_t  data_size   = 0;
-    u8*     data        = NULL;
+    ~TraceScope()
+    {
+        if(!trace) return;
+        event.duration = get_trace_time(*trace) - event.start;
+        std::thread::id id = std::this_thread::get_id();
+        std::lock_guard<std::mutex> lock(trace->mutex);
+        auto thread = std::find(trace->threads.begin(), trace->threads.end(), id);
+        if(thread == trace->threads.end())
+        {
+            thread = trace->threads.insert(thread, id);
+        }
+        event.thread = CAST(u32, thread - trace->threads.begin());
+        trace->events.push_back(std::move(event));
+    }
 };
 
-static void free_png_image(PngImage& png_image)
+#if !defined(MAKEICON_NO_MAIN) || defined(MAKEICON_BENCH)
+static std::string escape_json_string(const std::string& str)
 {
-    stbi_image_free(png_image.data);
-    png_image.data = NULL;
-    png_image.data_size = 0;
+    std::string result;
+    for(char c: str)
+    {
+        if(c == '"' || c == '\\') result += '\\';
+        if(CAST(u8, c) < 0x20) continue;
+        result += c;
+    }
+    return result;
 }
 
-// returns true on success, false on failure. The resized image is written to `output`.
-static bool resize_image(const Image& image, s32 output_width, s32 output_height, Image& output)
+// Writes the events in the Chrome trace event format, which chrome://tracing and Perfetto can open.
+static bool save_trace(const Trace& trace, const std::string& file_name)
 {
-    output.bpp = image.bpp;
-    output.width = output_width;
-    output.height = output_height;
-    output.data = CAST(u8*, malloc(output_width * output_height * image.bpp));
-    if (!output.data)
+    FILE* file = fopen(file_name.c_str(), "w");
+    if(!file)
     {
         return false;
     }
-    else
+    fprintf(file, "{\"traceEvents\":[\n");
+    for(size_t i=0; i<trace.threads.size(); ++i)
     {
-        stbir_resize_uint8_srgb(image.data, image.width, image.height, image.width * image.bpp,
-            output.data, output_width, output_height, output_width * image.bpp, image.bpp, 3, 0);
+        std::string name = (i == 0) ? "main" : "worker " + std::to_string(i);
+        fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}},\n", i, name.c_str());
     }
-    return true;
+    for(size_t i=0; i<trace.events.size(); ++i)
+    {
+        const TraceEvent& event = trace.events[i];
+        fprintf(file, "{\"name\":\"%s\",\"cat\":\"makeicon\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%lld,\"dur\":%lld,"
+            "\"args\":{\"detail\":\"%s\",\"size\":%d,\"bytes_in\":%llu,\"bytes_out\":%llu,\"pixels\":%llu}}%s\n",
+            event.name, event.thread, CAST(long long, event.start), CAST(long long, event.duration),
+            escape_json_string(event.detail).c_str(), event.size, CAST(unsigned long long, event.bytes_in),
+            CAST(unsigned long long, event.bytes_out), CAST(unsigned long long, event.pixels),
+            (i + 1 < trace.events.size()) ? "," : "");
+    }
+    fprintf(file, "]}\n");
+    return (fclose(file) == 0);
 }
 
-static void add_border(Image& image, f32 padding)
+// Formats the totals for each phase in the order they first ran, followed by how well each size compressed. Times
+// are summed over every thread so a phase that ran in parallel can add up to more than the wall clock time.
+static std::string format_trace_stats(const Trace& trace)
 {
-    padding = padding > 0.5f ? 0.5f: padding;
-    u32 inner_size_width = (1.0f - 2.0f * padding) * image.width;
-    u32 inner_size_height = (1.0f - 2.0f * padding) * image.height;
-
-    u8* padded_data = CAST(u8*, malloc(inner_size_width * inner_size_height * image.bpp));
-    stbir_resize_uint8_srgb(image.data, image.width, image.height, image.width * image.bpp,
-                            padded_data, inner_size_width, inner_size_height, inner_size_width * image.bpp, image.bpp, 3, 0);
-
-    u32 padded_width = padding * image.width;
-    u32 padded_height = padding * image.height;
-
-    u32 output_stride = image.width * image.bpp;
-    u32 src_stride = inner_size_width * image.bpp;
+    struct PhaseStats
+    {
+        const char* name;
+        u64         count, bytes_in, bytes_out, pixels;
+        s64         duration;
+    };
+    std::vector<TraceEvent> events = trace.events;
+    std::stable_sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) { return a.start < b.start; });
 
-    u8* output_dst = image.data + padded_width * image.bpp + output_stride * padded_height;
-    u8* src = padded_data;
-    memset(image.data, 0, image.width * image.height * image.bpp);
-    for (u32 y = 0; y < inner_size_height; ++y)
+    std::vector<PhaseStats> phases;
+    std::map<s32, std::pair<u64,u64>> compression; // Bytes before and after encoding for each size.
+    for(auto& event: events)
     {
-        memcpy(output_dst, src, inner_size_width * image.bpp);
-        output_dst += output_stride;
-        src += src_stride;
+        auto phase = std::find_if(phases.begin(), phases.end(), [&](const PhaseStats& p) { return strcmp(p.name, event.name) == 0; });
+        if(phase == phases.end())
+        {
+            phase = phases.insert(phase, PhaseStats { event.name, 0, 0, 0, 0, 0 });
+        }
+        phase->count++;
+        phase->bytes_in += event.bytes_in;
+        phase->bytes_out += event.bytes_out;
+        phase->pixels += event.pixels;
+        phase->duration += event.duration;
+        if(strcmp(event.name, "encode") == 0)
+        {
+            compression[event.size].first += event.bytes_in;
+            compression[event.size].second += event.bytes_out;
+        }
     }
-    free(padded_data);
-}
 
-static void apply_radius(u8* data, s32 width, s32 bpp, s32 cx, s32 cy,
-                        s32 startX, s32 endX, s32 startY, s32 endY, 
-                        s32 radius_squared)
-{
-    for (u32 y = startY; y < endY; ++y)
+    std::string stats;
+    char line[256];
+    snprintf(line, sizeof(line), "%-10s %8s %12s %12s %12s %12s\n", "phase", "count", "time (ms)", "mpixels", "in (KB)", "out (KB)");
+    stats += line;
+    for(auto& phase: phases)
+    {
+        snprintf(line, sizeof(line), "%-10s %8llu %12.3f %12.3f %12.1f %12.1f\n", phase.name, CAST(unsigned long long, phase.count),
+            phase.duration / 1000.0, phase.pixels / 1e6, phase.bytes_in / 1024.0, phase.bytes_out / 1024.0);
+        stats += line;
+    }
+    if(!compression.empty())
     {
-        for (u32 x = startX; x < endX; ++x)
+        snprintf(line, sizeof(line), "\n%-10s %12s %12s %8s\n", "size", "raw (KB)", "png (KB)", "ratio");
+        stats += line;
+        for(auto& [size, bytes]: compression)
         {
-            u32 d = (cy - y) * (cy - y) + (cx - x) * (cx - x);
-
-            if (d > radius_squared)
-            {
-                u32 pos = (y * width + x) * bpp;
-                memset(data + pos, 0, bpp);
-            }
+            snprintf(line, sizeof(line), "%-10d %12.1f %12.1f %7.2fx\n", size, bytes.first / 1024.0, bytes.second / 1024.0,
+                (bytes.second > 0) ? CAST(f64, bytes.first) / bytes.second : 0.0);
+            stats += line;
         }
     }
+    snprintf(line, sizeof(line), "\ntotal %.3f ms on %zu thread(s)\n", get_trace_time(trace) / 1000.0, trace.threads.size());
+    stats += line;
+    return stats;
 }
 
-static void add_corner_radius(Image& image, f32 radius)
+static void print_trace_stats(const Trace& trace)
 {
-    radius = radius > 0.5f ? 0.5f: radius;
+    fputs(format_trace_stats(trace).c_str(), stdout);
+}
+#endif
+
+//
+// PNG Encoding
+//
+
+// PNGs are written by us rather than through stbi_write_png_to_mem so that the filtering and deflate stages can be
+// picked per compression level. The default level produces exactly the same bytes as stb_image_write. Fast trades
+// size for throughput with a single filter and a greedy single-probe match finder, though each of its blocks still
+// gets Huffman codes built from the symbols it uses. Max tries every filter strategy with a deep lazy match search
+// and dynamic Huffman blocks, keeping whichever result is smallest.
 
-    s32 radius_squared = image.width * radius;
-    radius_squared *= radius_squared;               
-                                                    
-    s32 left = image.width * radius;
-    s32 right = image.width - left;
-    
-    s32 top = image.height * radius;
-    s32 bottom = image.height - top;
+static constexpr s32 PNG_FILTER_ADAPTIVE = -1; // Pick the filter per row using stb's minimum sum of absolute values heuristic.
+static constexpr s32 PNG_FILTER_FAST     =  2; // Up, the cheapest to compute and good for flat colour and gradients.
 
-    apply_radius(image.data, image.width, image.bpp, left, top, 0, left, 0, top, radius_squared); // top left
-    apply_radius(image.data, image.width, image.bpp, left, bottom, 0, left, bottom, image.height, radius_squared); // bottom left
-    apply_radius(image.data, image.width, image.bpp, right, top, right, image.width, 0, top, radius_squared); // top right
-    apply_radius(image.data, image.width, image.bpp, right, bottom, right, image.width, bottom, image.height, radius_squared); // bottom right
+// The row filters only ever see 4-byte RGBA pixels, so the SIMD kernels are specialized for that. The first row
+// is filtered against a row of zeros, which gives exactly the same bytes as stb's first row filter mapping.
+
+static inline u8 png_paeth(s32 a, s32 b, s32 c)
+{
+    s32 p = a + b - c, pa = abs(p-a), pb = abs(p-b), pc = abs(p-c);
+    if(pa <= pb && pa <= pc) return CAST(u8, a);
+    if(pb <= pc) return CAST(u8, b);
+    return CAST(u8, c);
 }
 
-static void modify_image(Image& image, const Options& options)
+// Filters bytes [start,end) of a row, this is the scalar fallback and also handles what the SIMD kernels leave over.
+static void png_filter_span(const u8* row, const u8* prev, s32 start, s32 end, s32 filter, u8* out)
 {
-    if (options.radius > 0.0f)
+    for(s32 i=start; i<end && i<4; ++i, ++start)
     {
-        add_corner_radius(image, options.radius);
+        switch(filter)
+        {
+            case 0: out[i] = row[i]; break;
+            case 1: out[i] = row[i]; break;
+            case 2: out[i] = row[i] - prev[i]; break;
+            case 3: out[i] = row[i] - (prev[i] >> 1); break;
+            case 4: out[i] = row[i] - png_paeth(0, prev[i], 0); break;
+        }
     }
-
-    if (options.padding > 0.0f)
+    switch(filter)
     {
-        add_border(image, options.padding);
+        case 0: for(s32 i=start; i<end; ++i) out[i] = row[i]; break;
+        case 1: for(s32 i=start; i<end; ++i) out[i] = row[i] - row[i-4]; break;
+        case 2: for(s32 i=start; i<end; ++i) out[i] = row[i] - prev[i]; break;
+        case 3: for(s32 i=start; i<end; ++i) out[i] = row[i] - ((row[i-4] + prev[i]) >> 1); break;
+        case 4: for(s32 i=start; i<end; ++i) out[i] = row[i] - png_paeth(row[i-4], prev[i], prev[i-4]); break;
     }
 }
 
-static bool save_image(const Image& image, std::string file_name, s32 resize_width = 0, s32 resize_height = 0)
+// Estimates the entropy of a filtered row as the sum of its bytes treated as signed values.
+static u32 png_row_score_scalar(const u8* out, s32 size)
+{
+    u32 score = 0;
+    for(s32 i=0; i<size; ++i) score += abs(CAST(s8, out[i]));
+    return score;
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define MAKEICON_SIMD_X64
+#endif
+
+#if defined(MAKEICON_SIMD_X64)
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define MAKEICON_TARGET_AVX2
+#else
+#include <immintrin.h>
+#define MAKEICON_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+static bool cpu_has_avx2()
 {
-    s32 output_width = (resize_width > 0) ? resize_width : image.width;
-    s32 output_height = (resize_height > 0) ? resize_height : image.height;
-    Image resized_image;
+    #if defined(_MSC_VER)
+    s32 info[4];
+    __cpuid(info, 0);
+    if(info[0] < 7) return false;
+    __cpuid(info, 1);
+    bool os_saves_ymm = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && ((_xgetbv(0) & 6) == 6);
+    if(!os_saves_ymm) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+    #else
+    return __builtin_cpu_supports("avx2");
+    #endif
+}
 
-    // If the resize options were specified then resize first, this also means we need to free output_data after as we allocate new memory.
-    bool did_resize_image = false;
-    if(output_width != image.width || output_height != image.height)
+// SSE2 is always available on x64 so this is the baseline kernel there.
+static void png_filter_row_sse2(const u8* row, const u8* prev, s32 size, s32 filter, u8* out)
+{
+    if(filter == 0)
+    {
+        memcpy(out, row, size);
+        return;
+    }
+    s32 i = std::min(size, 4);
+    png_filter_span(row, prev, 0, i, filter, out);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    for(; i+16<=size; i+=16)
     {
-        if (!resize_image(image, output_width, output_height, resized_image))
+        __m128i x = _mm_loadu_si128(CAST(const __m128i*, row + i));
+        __m128i a = _mm_loadu_si128(CAST(const __m128i*, row + i - 4));
+        __m128i b = _mm_loadu_si128(CAST(const __m128i*, prev + i));
+        __m128i pred;
+        switch(filter)
         {
-            return false;
+            case 1: pred = a; break;
+            case 2: pred = b; break;
+            case 3:
+            {
+                // _mm_avg_epu8 rounds up, take off the carried bit to get the floor the filter wants.
+                pred = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+            } break;
+            default:
+            {
+                __m128i c = _mm_loadu_si128(CAST(const __m128i*, prev + i - 4));
+                __m128i halves[2];
+                for(s32 h=0; h<2; ++h)
+                {
+                    __m128i a16 = (h) ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+                    __m128i b16 = (h) ? _mm_unpackhi_epi8(b, zero) : _mm_unpacklo_epi8(b, zero);
+                    __m128i c16 = (h) ? _mm_unpackhi_epi8(c, zero) : _mm_unpacklo_epi8(c, zero);
+                    __m128i bc = _mm_sub_epi16(b16, c16);
+                    __m128i ac = _mm_sub_epi16(a16, c16);
+                    __m128i abc = _mm_add_epi16(bc, ac);
+                    __m128i pa = _mm_max_epi16(bc, _mm_sub_epi16(zero, bc));
+                    __m128i pb = _mm_max_epi16(ac, _mm_sub_epi16(zero, ac));
+                    __m128i pc = _mm_max_epi16(abc, _mm_sub_epi16(zero, abc));
+                    __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+                    __m128i use_c = _mm_cmpgt_epi16(pb, pc);
+                    __m128i b_or_c = _mm_or_si128(_mm_and_si128(use_c, c16), _mm_andnot_si128(use_c, b16));
+                    halves[h] = _mm_or_si128(_mm_and_si128(not_a, b_or_c), _mm_andnot_si128(not_a, a16));
+                }
+                pred = _mm_packus_epi16(halves[0], halves[1]);
+            } break;
         }
-        did_resize_image = true;
+        _mm_storeu_si128(CAST(__m128i*, out + i), _mm_sub_epi8(x, pred));
     }
+    png_filter_span(row, prev, i, size, filter, out);
+}
 
-    stbi_write_png(file_name.c_str(), output_width, output_height, image.bpp, did_resize_image ? resized_image.data : image.data, output_width*image.bpp);
-
-    if(did_resize_image)
+static u32 png_row_score_sse2(const u8* out, s32 size)
+{
+    // The unsigned minimum of v and -v is the magnitude of v as a signed byte, including -128.
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    s32 i = 0;
+    for(; i+16<=size; i+=16)
     {
-        free_image(resized_image);
+        __m128i v = _mm_loadu_si128(CAST(const __m128i*, out + i));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_min_epu8(v, _mm_sub_epi8(zero, v)), zero));
     }
-
-    return true;
+    u32 score = CAST(u32, _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum)));
+    return score + png_row_score_scalar(out + i, size - i);
 }
 
-static void resize_and_save_image(const std::string& filename, const std::vector<Image>& input_images, s32 size, bool resize)
+MAKEICON_TARGET_AVX2 static void png_filter_row_avx2(const u8* row, const u8* prev, s32 size, s32 filter, u8* out)
 {
-    // Search for matching image input size to save out as PNG.
-    bool match_found = false;
-    for(auto& image: input_images)
+    if(filter == 0)
     {
-        if(image.width == size && image.height == size)
-        {
-            match_found = true;
-            save_image(image, filename);
-            break;
-        }
+        memcpy(out, row, size);
+        return;
     }
-    if(!match_found)
+    s32 i = std::min(size, 4);
+    png_filter_span(row, prev, 0, i, filter, out);
+    if(filter == 4)
     {
-        if(!resize)
+        // Paeth needs 16-bit intermediates, so it works through 16 bytes at a time.
+        for(; i+16<=size; i+=16)
         {
-            // If no match was found and resize wasn't specified then we fail.
-            ERROR("Size %d was requested but no input image of this size was provided! Potentially specify -resize to allow for reszing to this size.", size);
+            __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128(CAST(const __m128i*, row + i - 4)));
+            __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128(CAST(const __m128i*, prev + i)));
+            __m256i c = _mm256_cvtepu8_epi16(_mm_loadu_si128(CAST(const __m128i*, prev + i - 4)));
+            __m256i bc = _mm256_sub_epi16(b, c);
+            __m256i ac = _mm256_sub_epi16(a, c);
+            __m256i pa = _mm256_abs_epi16(bc);
+            __m256i pb = _mm256_abs_epi16(ac);
+            __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(bc, ac));
+            __m256i not_a = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb), _mm256_cmpgt_epi16(pa, pc));
+            __m256i b_or_c = _mm256_blendv_epi8(b, c, _mm256_cmpgt_epi16(pb, pc));
+            __m256i pred16 = _mm256_blendv_epi8(a, b_or_c, not_a);
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(pred16, pred16), 0x08);
+            __m128i x = _mm_loadu_si128(CAST(const __m128i*, row + i));
+            _mm_storeu_si128(CAST(__m128i*, out + i), _mm_sub_epi8(x, _mm256_castsi256_si128(packed)));
         }
-        else
+    }
+    else
+    {
+        const __m256i one = _mm256_set1_epi8(1);
+        for(; i+32<=size; i+=32)
         {
-            // If no match was found and resize was specified then we resize for this icon size (use the largest image).
-            save_image(input_images.at(input_images.size()-1), filename, size,size);
+            __m256i x = _mm256_loadu_si256(CAST(const __m256i*, row + i));
+            __m256i a = _mm256_loadu_si256(CAST(const __m256i*, row + i - 4));
+            __m256i b = _mm256_loadu_si256(CAST(const __m256i*, prev + i));
+            __m256i pred;
+            switch(filter)
+            {
+                case 1: pred = a; break;
+                case 2: pred = b; break;
+                default: pred = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one)); break;
+            }
+            _mm256_storeu_si256(CAST(__m256i*, out + i), _mm256_sub_epi8(x, pred));
         }
     }
+    png_filter_span(row, prev, i, size, filter, out);
 }
 
-static std::vector<u8> read_entire_binary_file(const std::string& file_name)
+MAKEICON_TARGET_AVX2 static u32 png_row_score_avx2(const u8* out, s32 size)
 {
-    std::ifstream file(file_name, std::ios::binary);
-    std::vector<u8> content;
-    content.resize(std::filesystem::file_size(file_name));
-    file.read(CAST(char*, &content[0]), content.size()*sizeof(u8));
-    return content;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sum = zero;
+    s32 i = 0;
+    for(; i+32<=size; i+=32)
+    {
+        __m256i v = _mm256_loadu_si256(CAST(const __m256i*, out + i));
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_abs_epi8(v), zero));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    u32 score = CAST(u32, _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(half, half)));
+    return score + png_row_score_scalar(out + i, size - i);
 }
 
-static void tokenize_string(const std::string& str, const char* delims, std::vector<std::string>& tokens)
+#endif // MAKEICON_SIMD_X64
+
+struct PngFilterKernels
 {
-    size_t prev = 0;
-    size_t pos;
+    void (*filter_row)(const u8* row, const u8* prev, s32 size, s32 filter, u8* out);
+    u32  (*row_score)(const u8* out, s32 size);
+};
 
-    while((pos = str.find_first_of(delims, prev)) != std::string::npos)
+// Picks the widest kernels the CPU supports, this is only done once.
+static const PngFilterKernels& get_png_filter_kernels()
+{
+    static const PngFilterKernels kernels = []()
     {
-        if(pos > prev) tokens.push_back(str.substr(prev, pos-prev));
-        prev = pos+1;
+        #if defined(MAKEICON_SIMD_X64)
+        if(cpu_has_avx2()) return PngFilterKernels { png_filter_row_avx2, png_row_score_avx2 };
+        return PngFilterKernels { png_filter_row_sse2, png_row_score_sse2 };
+        #else
+        auto filter_row = [](const u8* row, const u8* prev, s32 size, s32 filter, u8* out) { png_filter_span(row, prev, 0, size, filter, out); };
+        return PngFilterKernels { filter_row, png_row_score_scalar };
+        #endif
+    }();
+    return kernels;
+}
+
+// Writes each filtered row prefixed with its filter type into `filtered`, which must hold (width*4+1)*height bytes.
+// The kernels are the ones picked for the CPU unless others are passed in, which the benchmarks do to compare them.
+static void png_filter_image(const u8* pixels, s32 width, s32 height, s32 stride, s32 filter, u8* filtered, const PngFilterKernels& kernels = get_png_filter_kernels())
+{
+    s32 row_size = width * 4;
+    u8* zero_row = CAST(u8*, calloc(row_size, 1));
+    u8* candidate = CAST(u8*, malloc(row_size));
+    for(s32 y=0; y<height; ++y)
+    {
+        const u8* row = pixels + y * stride;
+        const u8* prev = (y > 0) ? row - stride : zero_row;
+        u8* dst = filtered + y * (row_size + 1);
+        if(filter >= 0)
+        {
+            dst[0] = CAST(u8, filter);
+            kernels.filter_row(row, prev, row_size, filter, dst + 1);
+            continue;
+        }
+        // Score every filter and keep the first one with the lowest estimated entropy, the same as stb.
+        dst[0] = 0;
+        kernels.filter_row(row, prev, row_size, 0, dst + 1);
+        u32 best_score = kernels.row_score(dst + 1, row_size);
+        for(s32 filter_type=1; filter_type<5; ++filter_type)
+        {
+            kernels.filter_row(row, prev, row_size, filter_type, candidate);
+            u32 score = kernels.row_score(candidate, row_size);
+            if(score < best_score)
+            {
+                best_score = score;
+                dst[0] = CAST(u8, filter_type);
+                memcpy(dst + 1, candidate, row_size);
+            }
+        }
     }
-    if(prev < str.length())
+    free(candidate);
+    free(zero_row);
+}
+
+struct BitWriter
+{
+    std::vector<u8> bytes;
+    u64             buffer = 0;
+    s32             count  = 0;
+};
+
+static inline void put_bits(BitWriter& writer, u32 bits, s32 count)
+{
+    writer.buffer |= CAST(u64, bits) << writer.count;
+    writer.count += count;
+    while(writer.count >= 8)
     {
-        tokens.push_back(str.substr(prev, std::string::npos));
+        writer.bytes.push_back(CAST(u8, writer.buffer));
+        writer.buffer >>= 8;
+        writer.count -= 8;
     }
 }
 
-static void print_version_message()
+static inline void flush_bits(BitWriter& writer)
 {
-    fprintf(stdout, "makeicon v%d.%d\n", MAKEICON_VERSION_MAJOR, MAKEICON_VERSION_MINOR);
+    if(writer.count > 0)
+    {
+        writer.bytes.push_back(CAST(u8, writer.buffer));
+    }
+    writer.buffer = 0;
+    writer.count = 0;
 }
 
-static void print_help_message()
+static constexpr s32 DEFLATE_WINDOW    = 32768;
+static constexpr s32 DEFLATE_MIN_MATCH = 3;
+static constexpr s32 DEFLATE_MAX_MATCH = 258;
+
+static constexpr u16 DEFLATE_LENGTH_BASE[29]  = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static constexpr u8  DEFLATE_LENGTH_EXTRA[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+static constexpr u16 DEFLATE_DIST_BASE[30]    = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+static constexpr u8  DEFLATE_DIST_EXTRA[30]   = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+// A literal (dist == 0) or a back-reference, produced by the match finders and consumed by the block writers.
+struct DeflateToken
 {
-    fprintf(stdout, "%s\n", MAKEICON_HELP_MESSAGE);
+    u16 value; // Literal byte or match length.
+    u16 dist;
+};
+
+struct DeflateTables
+{
+    u8  length_code[DEFLATE_MAX_MATCH+1];
+    u8  dist_code_lo[256]; // For distances 1..256.
+    u8  dist_code_hi[256]; // For distances 257..32768, indexed by (dist-1)>>7.
+    u16 fixed_lit_codes[288];
+    u8  fixed_lit_lengths[288];
+    u16 fixed_dist_codes[30];
+    u8  fixed_dist_lengths[30];
+};
+
+static u16 reverse_bits(u32 code, s32 count)
+{
+    u32 result = 0;
+    for(s32 i=0; i<count; ++i)
+    {
+        result = (result << 1) | (code & 1);
+        code >>= 1;
+    }
+    return CAST(u16, result);
 }
 
-static Argument format_argument(std::string arg_str)
+// Builds the canonical Huffman codes (bit-reversed, ready to be written LSB first) for a set of code lengths.
+static void build_huffman_codes(const u8* lengths, s32 count, u16* codes)
 {
-    // @Improve: Handle ill-formed argument error cases!
+    u16 bl_count[16] = {};
+    u16 next_code[16] = {};
+    for(s32 i=0; i<count; ++i) bl_count[lengths[i]]++;
+    bl_count[0] = 0;
+    u16 code = 0;
+    for(s32 bits=1; bits<16; ++bits)
+    {
+        code = CAST(u16, (code + bl_count[bits-1]) << 1);
+        next_code[bits] = code;
+    }
+    for(s32 i=0; i<count; ++i)
+    {
+        codes[i] = (lengths[i]) ? reverse_bits(next_code[lengths[i]]++, lengths[i]) : 0;
+    }
+}
 
-    // Remove the '-' character from the argument.
-    arg_str.erase(0,1);
-    // Split the argument into its name and (optional) parameters.
-    std::vector<std::string> tokens;
-    tokenize_string(arg_str, ":", tokens);
-    // Store the formatted argument information.
-    Argument arg;
-    if(!tokens.empty())
+static const DeflateTables& get_deflate_tables()
+{
+    static const DeflateTables tables = []()
     {
-        arg.name = tokens[0];
-        if(tokens.size() > 1) // We have parameters!
+        DeflateTables t = {};
+        for(s32 code=0; code<29; ++code)
         {
-            tokenize_string(tokens[1], ",", arg.params);
+            s32 end = (code < 28) ? DEFLATE_LENGTH_BASE[code+1] : DEFLATE_MAX_MATCH+1;
+            for(s32 len=DEFLATE_LENGTH_BASE[code]; len<end; ++len) t.length_code[len] = CAST(u8, code);
         }
-    }
-    return arg;
+        t.length_code[DEFLATE_MAX_MATCH] = 28;
+        for(s32 code=0; code<30; ++code)
+        {
+            s32 end = DEFLATE_DIST_BASE[code] + (1 << DEFLATE_DIST_EXTRA[code]);
+            for(s32 dist=DEFLATE_DIST_BASE[code]; dist<end; ++dist)
+            {
+                if(dist <= 256) t.dist_code_lo[dist-1] = CAST(u8, code);
+                else t.dist_code_hi[(dist-1) >> 7] = CAST(u8, code);
+            }
+        }
+        for(s32 i=0; i<288; ++i)
+        {
+            t.fixed_lit_lengths[i] = (i < 144) ? 8 : (i < 256) ? 9 : (i < 280) ? 7 : 8;
+        }
+        for(s32 i=0; i<30; ++i)
+        {
+            t.fixed_dist_lengths[i] = 5;
+        }
+        build_huffman_codes(t.fixed_lit_lengths, 288, t.fixed_lit_codes);
+        build_huffman_codes(t.fixed_dist_lengths, 30, t.fixed_dist_codes);
+        return t;
+    }();
+    return tables;
 }
 
-static s32 make_icon_win32(const Options& options, const std::vector<Image>& input_images);
-static s32 make_icon_android(const Options& options, const std::vector<Image>& input_images);
-static s32 make_icon_apple(const Options& options, const std::vector<Image>&input_images);
+static inline s32 deflate_dist_code(const DeflateTables& tables, s32 dist)
+{
+    return (dist <= 256) ? tables.dist_code_lo[dist-1] : tables.dist_code_hi[(dist-1) >> 7];
+}
 
-static s32 make_icon(const Options& options)
+static inline void put_deflate_match(BitWriter& writer, const DeflateTables& tables, s32 len, s32 dist,
+                                     const u16* lit_codes, const u8* lit_lengths, const u16* dist_codes, const u8* dist_lengths)
 {
-    std::vector<Image> input_images;
+    s32 lcode = tables.length_code[len];
+    put_bits(writer, lit_codes[257+lcode], lit_lengths[257+lcode]);
+    put_bits(writer, len - DEFLATE_LENGTH_BASE[lcode], DEFLATE_LENGTH_EXTRA[lcode]);
+    s32 dcode = deflate_dist_code(tables, dist);
+    put_bits(writer, dist_codes[dcode], dist_lengths[dcode]);
+    put_bits(writer, dist - DEFLATE_DIST_BASE[dcode], DEFLATE_DIST_EXTRA[dcode]);
+}
 
-    // Load all of the input images into memory.
-    for(auto& file_name: options.input)
+static void write_deflate_tokens(BitWriter& writer, const DeflateTables& tables, const DeflateToken* tokens, size_t count,
+                                 const u16* lit_codes, const u8* lit_lengths, const u16* dist_codes, const u8* dist_lengths)
+{
+    for(size_t i=0; i<count; ++i)
     {
-        Image image;
-        image.data = stbi_load(file_name.c_str(), &image.width,&image.height,&image.bpp,4); // We force to 4-channel RGBA.
-        image.bpp = 4;
-        if(!image.data)
+        const DeflateToken& token = tokens[i];
+        if(token.dist == 0)
         {
-            ERROR("Failed to load input image: %s", file_name.c_str());
+            put_bits(writer, lit_codes[token.value], lit_lengths[token.value]);
         }
         else
         {
-            // We warn about non-square images as they will be stretched to a square aspect.
-            if(image.width != image.height)
-            {
-                WARNING("Image file '%s' is not square and will be stretched! Consider changing its size.", file_name.c_str());
-            }
-            // We warn if two images are passed in with the same size.
-            for(auto& input: input_images)
-            {
-                if((input.width == image.width) && (input.height == image.height))
-                {
-                    WARNING("Two provided image files have the same siize of %dx%d! It is ambiguous which one will be used.", image.width,image.height);
-                    break;
-                }
-            }
-
-            input_images.push_back(image);
+            put_deflate_match(writer, tables, token.value, token.dist, lit_codes, lit_lengths, dist_codes, dist_lengths);
         }
     }
+    put_bits(writer, lit_codes[256], lit_lengths[256]); // End of block.
+}
 
-    for (auto& img : input_images)
+// Computes length-limited Huffman code lengths for the given symbol frequencies. At least two symbols always get
+// a code so that the resulting code is complete, which every inflate implementation accepts.
+static void build_code_lengths(const u32* input_freqs, s32 count, s32 max_bits, u8* lengths)
+{
+    std::vector<u32> freqs(input_freqs, input_freqs + count);
+    s32 used = 0;
+    for(s32 i=0; i<count; ++i) used += (freqs[i] > 0);
+    for(s32 i=0; used<2 && i<count; ++i)
     {
-        modify_image(img, options);
+        if(!freqs[i]) { freqs[i] = 1; ++used; }
     }
 
-    s32 result = EXIT_FAILURE;
-
-    // Run the icon generation code for the desired platform.
-    switch(options.platform)
+    struct Node { u32 freq; s32 left, right; };
+    std::vector<Node> nodes;
+    std::vector<s32> depth;
+    while(true)
     {
-        case Platform_Win32:
-        {
-            result = make_icon_win32(options, input_images);
-        } break;
-        case Platform_OSX:
-        case Platform_iOS:
+        // Standard two-queue Huffman construction over the symbols sorted by frequency.
+        nodes.clear();
+        std::vector<s32> leaves;
+        for(s32 i=0; i<count; ++i)
         {
-            result = make_icon_apple(options, input_images);
-        } break;
-        case Platform_Android:
+            if(freqs[i]) leaves.push_back(i);
+        }
+        std::stable_sort(leaves.begin(), leaves.end(), [&](s32 a, s32 b) { return freqs[a] < freqs[b]; });
+        for(auto symbol: leaves) nodes.push_back({ freqs[symbol], -1, symbol });
+
+        size_t leaf = 0, inner = nodes.size(), inner_end = nodes.size();
+        auto pop = [&]() -> s32
         {
-            result = make_icon_android(options, input_images);
-        } break;
-        default:
+            if(leaf < leaves.size() && (inner == inner_end || nodes[leaf].freq <= nodes[inner].freq)) return CAST(s32, leaf++);
+            return CAST(s32, inner++);
+        };
+        for(size_t n=1; n<leaves.size(); ++n)
         {
-            WARNING("Unknown platform ID used for making icon: %d", options.platform);
-        } break;
-    }
+            s32 a = pop();
+            s32 b = pop();
+            nodes.push_back({ nodes[a].freq + nodes[b].freq, a, b });
+            inner_end = nodes.size();
+        }
 
-    // Free all of the loaded to avoid memory leaking.
-    for(auto& image: input_images)
-    {
-        free_image(image);
+        // Walk down from the root to find the depth of every leaf.
+        depth.assign(nodes.size(), 0);
+        s32 max_depth = 0;
+        for(s32 n=CAST(s32, nodes.size())-1; n>=0; --n)
+        {
+            if(nodes[n].left >= 0)
+            {
+                depth[nodes[n].left] = depth[n] + 1;
+                depth[nodes[n].right] = depth[n] + 1;
+            }
+            else
+            {
+                max_depth = std::max(max_depth, depth[n]);
+            }
+        }
+        if(max_depth <= max_bits)
+        {
+            memset(lengths, 0, count);
+            for(size_t n=0; n<leaves.size(); ++n) lengths[nodes[n].right] = CAST(u8, depth[n]);
+            return;
+        }
+        // Too deep, flatten the distribution and try again.
+        for(auto& freq: freqs)
+        {
+            if(freq) freq = (freq + 1) / 2;
+        }
     }
+}
 
-    return result;
+static size_t deflate_block_cost(const u32* lit_freqs, const u32* dist_freqs, const u8* lit_lengths, const u8* dist_lengths)
+{
+    size_t bits = 0;
+    for(s32 i=0; i<286; ++i) bits += CAST(size_t, lit_freqs[i]) * (lit_lengths[i] + ((i > 256) ? DEFLATE_LENGTH_EXTRA[i-257] : 0));
+    for(s32 i=0; i<30; ++i) bits += CAST(size_t, dist_freqs[i]) * (dist_lengths[i] + DEFLATE_DIST_EXTRA[i]);
+    return bits;
 }
 
-int main(int argc, char** argv)
+// Writes a block using whichever of fixed or dynamic Huffman codes comes out smaller, given how often each literal,
+// length and distance code is used by the tokens. The end of block code is counted here.
+static void write_deflate_block(BitWriter& writer, const DeflateTables& tables, const DeflateToken* tokens, size_t count,
+                                u32* lit_freqs, const u32* dist_freqs, bool final)
 {
-    Options options;
+    lit_freqs[256] = 1;
 
+    u8 lit_lengths[286], dist_lengths[30];
+    build_code_lengths(lit_freqs, 286, 15, lit_lengths);
+    build_code_lengths(dist_freqs, 30, 15, dist_lengths);
+
+    s32 hlit = 286, hdist = 30;
+    while(hlit > 257 && !lit_lengths[hlit-1]) --hlit;
+    while(hdist > 1 && !dist_lengths[hdist-1]) --hdist;
+
+    // Run-length encode the code lengths with the 16 (repeat), 17 and 18 (zeros) codes.
+    u8 all_lengths[286+30];
+    memcpy(all_lengths, lit_lengths, hlit);
+    memcpy(all_lengths + hlit, dist_lengths, hdist);
+    s32 total = hlit + hdist;
+    std::vector<u8> rle_codes, rle_extra;
+    for(s32 i=0; i<total;)
+    {
+        s32 run = 1;
+        while(i + run < total && all_lengths[i+run] == all_lengths[i]) ++run;
+        if(all_lengths[i] == 0 && run >= 3)
+        {
+            run = std::min(run, 138);
+            rle_codes.push_back((run >= 11) ? 18 : 17);
+            rle_extra.push_back(CAST(u8, (run >= 11) ? run - 11 : run - 3));
+            i += run;
+        }
+        else if(all_lengths[i] != 0 && run >= 4)
+        {
+            rle_codes.push_back(all_lengths[i]);
+            rle_extra.push_back(0);
+            run = std::min(run - 1, 6);
+            rle_codes.push_back(16);
+            rle_extra.push_back(CAST(u8, run - 3));
+            i += run + 1;
+        }
+        else
+        {
+            rle_codes.push_back(all_lengths[i]);
+            rle_extra.push_back(0);
+            i += 1;
+        }
+    }
+
+    static constexpr u8 CLEN_ORDER[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+    u32 clen_freqs[19] = {};
+    for(auto code: rle_codes) clen_freqs[code]++;
+    u8 clen_lengths[19];
+    u16 clen_codes[19];
+    build_code_lengths(clen_freqs, 19, 7, clen_lengths);
+    build_huffman_codes(clen_lengths, 19, clen_codes);
+    s32 hclen = 19;
+    while(hclen > 4 && !clen_lengths[CLEN_ORDER[hclen-1]]) --hclen;
+
+    size_t header_bits = 14 + 3 * hclen;
+    for(size_t i=0; i<rle_codes.size(); ++i)
+    {
+        u8 code = rle_codes[i];
+        header_bits += clen_lengths[code] + ((code == 16) ? 2 : (code == 17) ? 3 : (code == 18) ? 7 : 0);
+    }
+    size_t dynamic_bits = header_bits + deflate_block_cost(lit_freqs, dist_freqs, lit_lengths, dist_lengths);
+    size_t fixed_bits = deflate_block_cost(lit_freqs, dist_freqs, tables.fixed_lit_lengths, tables.fixed_dist_lengths);
+
+    put_bits(writer, final ? 1 : 0, 1);
+    if(fixed_bits <= dynamic_bits)
+    {
+        put_bits(writer, 1, 2);
+        write_deflate_tokens(writer, tables, tokens, count, tables.fixed_lit_codes, tables.fixed_lit_lengths, tables.fixed_dist_codes, tables.fixed_dist_lengths);
+        return;
+    }
+
+    u16 lit_codes[286], dist_codes[30];
+    build_huffman_codes(lit_lengths, 286, lit_codes);
+    build_huffman_codes(dist_lengths, 30, dist_codes);
+
+    put_bits(writer, 2, 2);
+    put_bits(writer, hlit - 257, 5);
+    put_bits(writer, hdist - 1, 5);
+    put_bits(writer, hclen - 4, 4);
+    for(s32 i=0; i<hclen; ++i) put_bits(writer, clen_lengths[CLEN_ORDER[i]], 3);
+    for(size_t i=0; i<rle_codes.size(); ++i)
+    {
+        u8 code = rle_codes[i];
+        put_bits(writer, clen_codes[code], clen_lengths[code]);
+        if(code == 16) put_bits(writer, rle_extra[i], 2);
+        if(code == 17) put_bits(writer, rle_extra[i], 3);
+        if(code == 18) put_bits(writer, rle_extra[i], 7);
+    }
+    write_deflate_tokens(writer, tables, tokens, count, lit_codes, lit_lengths, dist_codes, dist_lengths);
+}
+
+static void write_deflate_block(BitWriter& writer, const DeflateTables& tables, const DeflateToken* tokens, size_t count, bool final)
+{
+    u32 lit_freqs[286] = {};
+    u32 dist_freqs[30] = {};
+    for(size_t i=0; i<count; ++i)
+    {
+        if(tokens[i].dist == 0)
+        {
+            lit_freqs[tokens[i].value]++;
+        }
+        else
+        {
+            lit_freqs[257 + tables.length_code[tokens[i].value]]++;
+            dist_freqs[deflate_dist_code(tables, tokens[i].dist)]++;
+        }
+    }
+    write_deflate_block(writer, tables, tokens, count, lit_freqs, dist_freqs, final);
+}
+
+static inline s32 match_length(const u8* a, const u8* b, s32 limit)
+{
+    s32 len = 0;
+    while(len < limit && a[len] == b[len]) ++len;
+    return len;
+}
+
+// Greedy match finder that only ever probes the most recent position with the same hash. The tokens are gathered a
+// block at a time and counted as they are found, so each block gets Huffman codes built for it without another pass
+// over the data.
+static void deflate_fast(const u8* data, s32 size, BitWriter& writer)
+{
+    static constexpr s32 HASH_BITS = 14;
+    static constexpr size_t BLOCK_TOKENS = 1 << 14;
+    const DeflateTables& tables = get_deflate_tables();
+    std::vector<s32> head(1 << HASH_BITS, -DEFLATE_WINDOW-1);
+
+    std::vector<DeflateToken> tokens(BLOCK_TOKENS);
+    size_t count = 0;
+    u32 lit_freqs[286] = {};
+    u32 dist_freqs[30] = {};
+    auto flush_block = [&](bool final)
+    {
+        write_deflate_block(writer, tables, tokens.data(), count, lit_freqs, dist_freqs, final);
+        count = 0;
+        memset(lit_freqs, 0, sizeof(lit_freqs));
+        memset(dist_freqs, 0, sizeof(dist_freqs));
+    };
+
+    s32 i = 0;
+    while(i < size)
+    {
+        if(count == BLOCK_TOKENS)
+        {
+            flush_block(false);
+        }
+        s32 len = 0;
+        s32 dist = 0;
+        if(i + 4 <= size)
+        {
+            u32 word;
+            memcpy(&word, data + i, sizeof(word));
+            u32 h = (word * 2654435761u) >> (32 - HASH_BITS);
+            s32 candidate = head[h];
+            head[h] = i;
+            dist = i - candidate;
+            if(dist <= DEFLATE_WINDOW && memcmp(data + candidate, data + i, DEFLATE_MIN_MATCH) == 0)
+            {
+                len = DEFLATE_MIN_MATCH + match_length(data + candidate + DEFLATE_MIN_MATCH, data + i + DEFLATE_MIN_MATCH, std::min(DEFLATE_MAX_MATCH, size - i) - DEFLATE_MIN_MATCH);
+            }
+        }
+        if(len)
+        {
+            tokens[count++] = { CAST(u16, len), CAST(u16, dist) };
+            lit_freqs[257 + tables.length_code[len]]++;
+            dist_freqs[deflate_dist_code(tables, dist)]++;
+            i += len;
+        }
+        else
+        {
+            tokens[count++] = { data[i], 0 };
+            lit_freqs[data[i]]++;
+            i += 1;
+        }
+    }
+    flush_block(true);
+}
+
+// Hash chain match finder with lazy evaluation that searches deep into every chain, the tokens are split into
+// blocks that each get their own Huffman codes.
+static void deflate_max(const u8* data, s32 size, BitWriter& writer)
+{
+    static constexpr s32 HASH_BITS   = 15;
+    static constexpr s32 MAX_CHAIN   = 4096;
+    static constexpr s32 NICE_LENGTH = DEFLATE_MAX_MATCH;
+    static constexpr size_t BLOCK_TOKENS = 1 << 15;
+    const DeflateTables& tables = get_deflate_tables();
+
+    std::vector<s32> head(1 << HASH_BITS, -1);
+    std::vector<s32> prev(std::max(size, 1), -1);
+    auto hash3 = [&](s32 pos) { return ((data[pos] << 10) ^ (data[pos+1] << 5) ^ data[pos+2]) & ((1 << HASH_BITS) - 1); };
+    auto insert = [&](s32 pos)
+    {
+        if(pos + DEFLATE_MIN_MATCH > size) return;
+        s32 h = hash3(pos);
+        prev[pos] = head[h];
+        head[h] = pos;
+    };
+    auto find = [&](s32 pos, s32& best_dist) -> s32
+    {
+        s32 limit = std::min(DEFLATE_MAX_MATCH, size - pos);
+        if(limit < DEFLATE_MIN_MATCH) return 0;
+        s32 best = DEFLATE_MIN_MATCH - 1;
+        s32 chain = MAX_CHAIN;
+        for(s32 candidate = head[hash3(pos)]; candidate >= 0 && pos - candidate <= DEFLATE_WINDOW && chain--; candidate = prev[candidate])
+        {
+            if(data[candidate + best] != data[pos + best]) continue;
+            s32 len = match_length(data + candidate, data + pos, limit);
+            if(len > best)
+            {
+                best = len;
+                best_dist = pos - candidate;
+                if(len >= NICE_LENGTH || len >= limit) break;
+            }
+        }
+        return (best >= DEFLATE_MIN_MATCH) ? best : 0;
+    };
+
+    std::vector<DeflateToken> tokens;
+    s32 i = 0;
+    while(i < size)
+    {
+        s32 dist = 0;
+        s32 len = find(i, dist);
+        if(len)
+        {
+            // Lazy matching, if the next position has a longer match then emit this byte as a literal instead.
+            insert(i);
+            s32 next_dist = 0;
+            s32 next_len = (len < NICE_LENGTH && i + 1 < size) ? find(i + 1, next_dist) : 0;
+            if(next_len > len)
+            {
+                tokens.push_back({ data[i], 0 });
+                i += 1;
+                continue;
+            }
+            tokens.push_back({ CAST(u16, len), CAST(u16, dist) });
+            for(s32 j=1; j<len; ++j) insert(i + j);
+            i += len;
+        }
+        else
+        {
+            insert(i);
+            tokens.push_back({ data[i], 0 });
+            i += 1;
+        }
+    }
+
+    if(tokens.empty())
+    {
+        write_deflate_block(writer, tables, NULL, 0, true);
+        return;
+    }
+    for(size_t start=0; start<tokens.size(); start+=BLOCK_TOKENS)
+    {
+        size_t count = std::min(BLOCK_TOKENS, tokens.size() - start);
+        write_deflate_block(writer, tables, tokens.data() + start, count, start + count == tokens.size());
+    }
+}
+
+static u32 adler32(const u8* data, size_t size)
+{
+    u32 s1 = 1, s2 = 0;
+    while(size > 0)
+    {
+        size_t block = std::min(size, CAST(size_t, 5552));
+        for(size_t i=0; i<block; ++i) { s1 += data[i]; s2 += s1; }
+        s1 %= 65521; s2 %= 65521;
+        data += block;
+        size -= block;
+    }
+    return (s2 << 16) | s1;
+}
+
+// Returns a malloc'd zlib stream for the data.
+static u8* png_zlib_compress(u8* data, s32 size, Compression compression, s32* out_size)
+{
+    if(compression == Compression_Default)
+    {
+        return stbi_zlib_compress(data, size, out_size, stbi_write_png_compression_level);
+    }
+
+    BitWriter writer;
+    writer.bytes.reserve(size / 2 + 64);
+    writer.bytes.push_back(0x78);
+    writer.bytes.push_back((compression == Compression_Fast) ? 0x01 : 0xDA); // FLEVEL fastest or maximum.
+    if(compression == Compression_Fast) deflate_fast(data, size, writer);
+    else deflate_max(data, size, writer);
+    flush_bits(writer);
+    u32 adler = adler32(data, size);
+    writer.bytes.push_back(CAST(u8, adler >> 24));
+    writer.bytes.push_back(CAST(u8, adler >> 16));
+    writer.bytes.push_back(CAST(u8, adler >> 8));
+    writer.bytes.push_back(CAST(u8, adler));
+
+    u8* out = CAST(u8*, malloc(writer.bytes.size()));
+    if(out)
+    {
+        memcpy(out, writer.bytes.data(), writer.bytes.size());
+        *out_size = CAST(s32, writer.bytes.size());
+    }
+    return out;
+}
+
+static void png_write_u32(u8*& out, u32 value)
+{
+    out[0] = CAST(u8, value >> 24);
+    out[1] = CAST(u8, value >> 16);
+    out[2] = CAST(u8, value >> 8);
+    out[3] = CAST(u8, value);
+    out += 4;
+}
+
+static void png_write_chunk_crc(u8*& out, s32 data_size)
+{
+    png_write_u32(out, stbiw__crc32(out - data_size - 4, data_size + 4));
+}
+
+// Encodes 8-bit RGBA pixels as a PNG, returns a malloc'd buffer or NULL on failure.
+static u8* encode_png(const u8* pixels, s32 width, s32 height, s32 stride, Compression compression, s32* out_size)
+{
+    TraceScope scope("encode");
+    scope.event.size = width;
+    scope.event.pixels = CAST(u64, width) * height;
+    scope.event.bytes_in = scope.event.pixels * 4;
+
+    s32 filtered_size = (width * 4 + 1) * height;
+    u8* filtered = CAST(u8*, malloc(filtered_size));
+    if(!filtered) return NULL;
+
+    u8* zlib = NULL;
+    s32 zlib_size = 0;
+    if(compression == Compression_Max)
+    {
+        // Try every filter strategy and keep the smallest stream.
+        for(s32 filter=PNG_FILTER_ADAPTIVE; filter<5; ++filter)
+        {
+            png_filter_image(pixels, width, height, stride, filter, filtered);
+            s32 size = 0;
+            u8* candidate = png_zlib_compress(filtered, filtered_size, compression, &size);
+            if(candidate && (!zlib || size < zlib_size))
+            {
+                free(zlib);
+                zlib = candidate;
+                zlib_size = size;
+            }
+            else
+            {
+                free(candidate);
+            }
+        }
+    }
+    else
+    {
+        png_filter_image(pixels, width, height, stride, (compression == Compression_Fast) ? PNG_FILTER_FAST : PNG_FILTER_ADAPTIVE, filtered);
+        zlib = png_zlib_compress(filtered, filtered_size, compression, &zlib_size);
+    }
+    free(filtered);
+    if(!zlib) return NULL;
+
+    // Each chunk requires 12 bytes of overhead.
+    static constexpr u8 PNG_SIGNATURE[8] = { 137,80,78,71,13,10,26,10 };
+    s32 size = 8 + 12+13 + 12+zlib_size + 12;
+    u8* png = CAST(u8*, malloc(size));
+    if(!png)
+    {
+        free(zlib);
+        return NULL;
+    }
+
+    u8* o = png;
+    memcpy(o, PNG_SIGNATURE, 8); o += 8;
+    png_write_u32(o, 13);
+    memcpy(o, "IHDR", 4); o += 4;
+    png_write_u32(o, width);
+    png_write_u32(o, height);
+    *o++ = 8; // Bit depth.
+    *o++ = 6; // Colour type RGBA.
+    *o++ = 0;
+    *o++ = 0;
+    *o++ = 0;
+    png_write_chunk_crc(o, 13);
+
+    png_write_u32(o, zlib_size);
+    memcpy(o, "IDAT", 4); o += 4;
+    memcpy(o, zlib, zlib_size); o += zlib_size;
+    png_write_chunk_crc(o, zlib_size);
+    free(zlib);
+
+    png_write_u32(o, 0);
+    memcpy(o, "IEND", 4); o += 4;
+    png_write_chunk_crc(o, 0);
+
+    *out_size = size;
+    scope.event.bytes_out = size;
+    return png;
+}
+
+struct PngImage
+{
+    PngImage() = default;
+
+    explicit PngImage(const Image& image, Compression compression = Compression_Default)
+    {
+        s32 mem_size = 0;
+        s32 stride_in_bytes = image.width * 4;
+        width = image.width;
+        height = image.height;
+        data = encode_png(image.data, width, height, stride_in_bytes, compression, &mem_size);
+        data_size = mem_size;
+    }
+
+    s32     width       = 0;
+    s32     height      = 0;
+    size_t  data_size   = 0;
+    u8*     data        = NULL;
+};
+
+static void free_png_image(PngImage& png_image)
+{
+    free(png_image.data);
+    png_image.data = NULL;
+    png_image.data_size = 0;
+}
+
+// Resizes the image into a region of memory with the given stride, which lets callers resize straight into part of
+// a larger image.
+static void resize_image_into(const Image& image, u8* output, s32 output_width, s32 output_height, s32 output_stride)
+{
+    TraceScope scope("resize");
+    scope.event.size = output_width;
+    scope.event.pixels = CAST(u64, output_width) * output_height;
+    scope.event.bytes_in = CAST(u64, image.width) * image.height * image.bpp;
+    scope.event.bytes_out = scope.event.pixels * image.bpp;
+
+    stbir_resize_uint8_srgb(image.data, image.width, image.height, image.width * image.bpp,
+        output, output_width, output_height, output_stride, image.bpp, 3, 0);
+}
+
+// returns true on success, false on failure. The resized image is written to `output`.
+static bool resize_image(const Image& image, s32 output_width, s32 output_height, Image& output)
+{
+    output.bpp = image.bpp;
+    output.width = output_width;
+    output.height = output_height;
+    output.data = CAST(u8*, malloc(output_width * output_height * image.bpp));
+    if (!output.data)
+    {
+        return false;
+    }
+    else
+    {
+        resize_image_into(image, output.data, output_width, output_height, output_width * image.bpp);
+    }
+    return true;
+}
+
+//
+// Linear Light
+//
+
+// In linear mode each source is converted once to 16-bit linear light with the colour premultiplied by alpha, every
+// output size is resampled from that buffer, and only the final pixels are converted back to 8-bit sRGB. This saves
+// redoing the sRGB decode of the whole source for every size that gets resized from it.
+struct LinearImage
+{
+    s32  width  = 0;
+    s32  height = 0;
+    u16* data   = NULL; // Premultiplied RGBA, alpha is stored as a*257.
+};
+
+static void free_linear_image(LinearImage& image)
+{
+    free(image.data);
+    image.data = NULL;
+}
+
+struct LinearTables
+{
+    u16 srgb_to_linear[256];
+    u8  linear_to_srgb[65536];
+};
+
+static const LinearTables& get_linear_tables()
+{
+    static const LinearTables tables = []()
+    {
+        LinearTables t;
+        for(s32 i=0; i<256; ++i)
+        {
+            f32 c = i / 255.0f;
+            f32 linear = (c <= 0.04045f) ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+            t.srgb_to_linear[i] = CAST(u16, linear * 65535.0f + 0.5f);
+        }
+        for(s32 i=0; i<65536; ++i)
+        {
+            f32 linear = i / 65535.0f;
+            f32 c = (linear <= 0.0031308f) ? linear * 12.92f : 1.055f * powf(linear, 1.0f / 2.4f) - 0.055f;
+            t.linear_to_srgb[i] = CAST(u8, std::clamp(c, 0.0f, 1.0f) * 255.0f + 0.5f);
+        }
+        return t;
+    }();
+    return tables;
+}
+
+// returns true on success, false on failure.
+static bool linearize_image(const Image& image, LinearImage& output)
+{
+    TraceScope scope("linearize");
+    const LinearTables& tables = get_linear_tables();
+    size_t pixel_count = CAST(size_t, image.width) * image.height;
+    output.width = image.width;
+    output.height = image.height;
+    output.data = CAST(u16*, malloc(pixel_count * 4 * sizeof(u16)));
+    if(!output.data)
+    {
+        return false;
+    }
+    scope.event.size = image.width;
+    scope.event.pixels = pixel_count;
+    scope.event.bytes_in = pixel_count * 4;
+    scope.event.bytes_out = pixel_count * 4 * sizeof(u16);
+
+    const u8* src = image.data;
+    u16* dst = output.data;
+    for(size_t i=0; i<pixel_count; ++i, src+=4, dst+=4)
+    {
+        u32 a = src[3];
+        dst[0] = CAST(u16, (tables.srgb_to_linear[src[0]] * a + 127) / 255);
+        dst[1] = CAST(u16, (tables.srgb_to_linear[src[1]] * a + 127) / 255);
+        dst[2] = CAST(u16, (tables.srgb_to_linear[src[2]] * a + 127) / 255);
+        dst[3] = CAST(u16, a * 257);
+    }
+    return true;
+}
+
+// returns true on success, false on failure. The resized image is written to `output`.
+static bool resize_linear_image(const LinearImage& image, s32 output_width, s32 output_height, LinearImage& output)
+{
+    output.width = output_width;
+    output.height = output_height;
+    output.data = CAST(u16*, malloc(CAST(size_t, output_width) * output_height * 4 * sizeof(u16)));
+    if(!output.data)
+    {
+        return false;
+    }
+    TraceScope scope("resize");
+    scope.event.size = output_width;
+    scope.event.pixels = CAST(u64, output_width) * output_height;
+    scope.event.bytes_in = CAST(u64, image.width) * image.height * 4 * sizeof(u16);
+    scope.event.bytes_out = scope.event.pixels * 4 * sizeof(u16);
+
+    stbir_resize_uint16_generic(image.data, image.width, image.height, image.width * 4 * sizeof(u16),
+        output.data, output_width, output_height, output_width * 4 * sizeof(u16), 4, 3, STBIR_FLAG_ALPHA_PREMULTIPLIED,
+        STBIR_EDGE_CLAMP, STBIR_FILTER_DEFAULT, STBIR_COLORSPACE_LINEAR, NULL);
+    return true;
+}
+
+// Converts back to straight alpha 8-bit sRGB, writing rows `stride` bytes apart.
+static void quantize_linear_image_into(const LinearImage& image, u8* output, s32 stride)
+{
+    const LinearTables& tables = get_linear_tables();
+    for(s32 y=0; y<image.height; ++y)
+    {
+        const u16* src = image.data + CAST(size_t, y) * image.width * 4;
+        u8* dst = output + CAST(size_t, y) * stride;
+        for(s32 x=0; x<image.width; ++x, src+=4, dst+=4)
+        {
+            u32 a = src[3];
+            if(a == 0)
+            {
+                memset(dst, 0, 4);
+                continue;
+            }
+            for(s32 c=0; c<3; ++c)
+            {
+                dst[c] = tables.linear_to_srgb[std::min(65535u, (src[c] * 65535u + a / 2) / a)];
+            }
+            dst[3] = CAST(u8, (a * 255 + 32767) / 65535);
+        }
+    }
+}
+
+// The corners are cut with a quarter circle mask worked out once per radius. Each mask row stores how many pixels
+// in from the edge are fully outside the circle and the anti-aliased coverage of the pixels between those and the
+// first pixel that is fully inside, so applying it only touches the pixels that actually change.
+struct CornerMaskRow
+{
+    s32 clear  = 0; // Pixels from the edge that are fully outside the circle.
+    s32 opaque = 0; // Pixels from the edge up to the first one that is fully inside.
+    u32 offset = 0; // Where the row's (opaque-clear) coverage values start in the coverage arrays.
+};
+
+struct CornerMask
+{
+    std::vector<CornerMaskRow> rows;           // Indexed by distance from the top (or bottom) edge.
+    std::vector<u8>            coverage_left;  // Coverage of each partial pixel, going inwards from the left edge.
+    std::vector<u8>            coverage_right; // The same values mirrored, going outwards to the right edge.
+};
+
+static void build_corner_mask(f32 radius, CornerMask& mask)
+{
+    s32 extent = CAST(s32, ceilf(radius));
+    mask.rows.resize(extent);
+    for(s32 y=0; y<extent; ++y)
+    {
+        CornerMaskRow& row = mask.rows[y];
+        f32 dy = std::max(0.0f, radius - (y + 0.5f));
+        row.clear = extent;
+        row.opaque = extent;
+        row.offset = CAST(u32, mask.coverage_left.size());
+        for(s32 x=0; x<extent; ++x)
+        {
+            // Coverage is approximated from the distance between the pixel centre and the edge of the circle.
+            f32 dx = std::max(0.0f, radius - (x + 0.5f));
+            f32 coverage = radius - sqrtf(dx*dx + dy*dy) + 0.5f;
+            u8 value = CAST(u8, std::clamp(coverage, 0.0f, 1.0f) * 255.0f + 0.5f);
+            if(value == 0)
+            {
+                continue;
+            }
+            if(row.clear == extent)
+            {
+                row.clear = x;
+            }
+            if(value == 255)
+            {
+                row.opaque = x;
+                break;
+            }
+            mask.coverage_left.push_back(value);
+        }
+        if(row.clear > row.opaque)
+        {
+            row.clear = row.opaque;
+        }
+        mask.coverage_right.insert(mask.coverage_right.end(), mask.coverage_left.rbegin(), mask.coverage_left.rbegin() + (row.opaque - row.clear));
+    }
+}
+
+// Masks are shared by every image that uses the same radius in pixels, which is usually every output of a size.
+static const CornerMask& get_corner_mask(f32 radius)
+{
+    static std::mutex mutex;
+    static std::map<f32, std::unique_ptr<CornerMask>> masks;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& mask = masks[radius];
+    if(!mask)
+    {
+        mask = std::make_unique<CornerMask>();
+        build_corner_mask(radius, *mask);
+    }
+    return *mask;
+}
+
+// Scales the alpha of `count` RGBA pixels by the matching coverage values, rounding to nearest.
+static void attenuate_alpha(u8* pixels, const u8* coverage, s32 count)
+{
+    s32 i = 0;
+    #if defined(MAKEICON_SIMD_X64)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi32(128);
+    const __m128i rgb_mask = _mm_set1_epi32(0x00FFFFFF);
+    for(; i+4<=count; i+=4)
+    {
+        u32 packed_coverage;
+        memcpy(&packed_coverage, coverage + i, sizeof(packed_coverage));
+        __m128i c = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(CAST(s32, packed_coverage)), zero), zero);
+        __m128i p = _mm_loadu_si128(CAST(const __m128i*, pixels + i*4));
+        __m128i t = _mm_add_epi32(_mm_mullo_epi16(_mm_srli_epi32(p, 24), c), half);
+        __m128i alpha = _mm_srli_epi32(_mm_add_epi32(t, _mm_srli_epi32(t, 8)), 8);
+        _mm_storeu_si128(CAST(__m128i*, pixels + i*4), _mm_or_si128(_mm_and_si128(p, rgb_mask), _mm_slli_epi32(alpha, 24)));
+    }
+    #endif
+    for(; i<count; ++i)
+    {
+        u32 t = pixels[i*4+3] * coverage[i] + 128;
+        pixels[i*4+3] = CAST(u8, (t + (t >> 8)) >> 8);
+    }
+}
+
+// Rounds the corners of an RGBA image (or of a region of one, using the stride).
+static void add_corner_radius(u8* data, s32 width, s32 height, s32 stride, f32 radius)
+{
+    TraceScope scope("modify");
+    scope.event.size = width;
+    scope.event.pixels = CAST(u64, width) * height;
+
+    radius = radius > 0.5f ? 0.5f: radius;
+
+    const CornerMask& mask = get_corner_mask(std::min(width, height) * radius);
+    s32 extent = CAST(s32, mask.rows.size());
+    for(s32 y=0; y<height; ++y)
+    {
+        s32 mask_y = std::min(y, height-1-y);
+        if(mask_y >= extent)
+        {
+            y = height-1-extent; // Skip the rows in the middle that are never masked.
+            continue;
+        }
+        const CornerMaskRow& row = mask.rows[mask_y];
+        s32 partial = row.opaque - row.clear;
+        // If the corners meet in the middle only mask the right side up to where the left side stopped.
+        s32 right_limit = std::max(row.opaque, width - row.opaque);
+        u8* pixels = data + y * stride;
+        memset(pixels, 0, std::min(row.clear, width) * 4);
+        attenuate_alpha(pixels + row.clear*4, mask.coverage_left.data() + row.offset, std::min(partial, width - row.clear));
+        s32 right_opaque = width - row.opaque;
+        s32 right_clear = width - row.clear;
+        s32 skip = std::max(0, right_limit - right_opaque);
+        if(skip < partial)
+        {
+            attenuate_alpha(pixels + (right_opaque + skip)*4, mask.coverage_right.data() + row.offset + skip, partial - skip);
+        }
+        s32 clear_start = std::max(right_clear, right_limit);
+        if(clear_start < width)
+        {
+            memset(pixels + clear_start*4, 0, (width - clear_start) * 4);
+        }
+    }
+}
+
+// The padding is applied by shrinking the icon to an inner square centered in the output.
+static void get_padded_rect(s32 size, f32 padding, s32& offset, s32& inner_size)
+{
+    padding = padding > 0.5f ? 0.5f: padding;
+    inner_size = CAST(s32, lroundf((1.0f - 2.0f * padding) * size));
+    offset = (size - inner_size) / 2;
+}
+
+// Produces a size x size icon from the source with the padding and corner radius applied at the output resolution.
+// The source is resized straight into the padded inner square of the output so it is only ever resampled once, if
+// the source is already the size of the inner square it is copied instead. Otherwise when a linear image is given it
+// is resized in place of the source. Returns false if allocation fails.
+static bool render_image(const Image& source, const LinearImage* linear, s32 size, f32 padding, f32 radius, Image& output)
+{
+    assert(source.bpp == 4); // Images are always decoded as RGBA.
+
+    s32 offset = 0, inner_size = 0;
+    get_padded_rect(size, padding, offset, inner_size);
+
+    output.bpp = source.bpp;
+    output.width = size;
+    output.height = size;
+    output.data = CAST(u8*, malloc(size * size * output.bpp));
+    if(!output.data)
+    {
+        return false;
+    }
+    if(inner_size < size)
+    {
+        memset(output.data, 0, size * size * output.bpp);
+    }
+    if(inner_size <= 0)
+    {
+        return true;
+    }
+
+    s32 stride = size * output.bpp;
+    u8* inner = output.data + offset * stride + offset * output.bpp;
+    if(source.width == inner_size && source.height == inner_size)
+    {
+        for(s32 y=0; y<inner_size; ++y)
+        {
+            memcpy(inner + y * stride, source.data + y * source.width * source.bpp, inner_size * source.bpp);
+        }
+    }
+    else if(linear && linear->width == inner_size && linear->height == inner_size)
+    {
+        quantize_linear_image_into(*linear, inner, stride);
+    }
+    else if(linear)
+    {
+        LinearImage resized;
+        if(!resize_linear_image(*linear, inner_size, inner_size, resized))
+        {
+            free_image(output);
+            return false;
+        }
+        quantize_linear_image_into(resized, inner, stride);
+        free_linear_image(resized);
+    }
+    else
+    {
+        resize_image_into(source, inner, inner_size, inner_size, stride);
+    }
+
+    if(radius > 0.0f)
+    {
+        add_corner_radius(inner, inner_size, inner_size, stride, radius);
+    }
+    return true;
+}
+
+// Returns the index of the input image that an icon of the given size should be produced from, or -1 if
+// there is no suitable input. The input images must be sorted from smallest to largest (which is done by
+// load_input_images) and only their dimensions are used, so this also works on probed images.
+static s32 find_source_image(const std::vector<Image>& input_images, s32 size, bool resize)
+{
+    for(size_t i=0; i<input_images.size(); ++i)
+    {
+        if(input_images[i].width == size && input_images[i].height == size)
+        {
+            return CAST(s32, i);
+        }
+    }
+    if(resize && !input_images.empty())
+    {
+        // If no match was found and resize was specified then we downsample from the smallest image that
+        // is at least as large as the requested size, or upsample the largest image if none are big enough.
+        for(size_t i=0; i<input_images.size(); ++i)
+        {
+            if(input_images[i].width >= size && input_images[i].height >= size)
+            {
+                return CAST(s32, i);
+            }
+        }
+        return CAST(s32, input_images.size()-1);
+    }
+    return -1;
+}
+
+// A single output PNG file to be produced at a given pixel size.
+struct RenderJob
+{
+    std::string filename;
+    s32         size = 0;
+    std::string idiom; // The apple device family the image is for, empty on the other platforms.
+    const char* element = NULL; // The element type the image is stored as when packing an .icns file.
+};
+
+static std::vector<u8> read_entire_binary_file(const std::string& file_name)
+{
+    std::ifstream file(file_name, std::ios::binary);
+    std::vector<u8> content;
+    content.resize(std::filesystem::file_size(file_name));
+    file.read(CAST(char*, content.data()), content.size()*sizeof(u8));
+    return content;
+}
+
+// A read-only view of a whole file. Inputs are memory mapped so that hashing, header probing and decoding all read
+// the same pages straight from the page cache, if mapping fails the file is read into memory instead. Inputs given
+// to the library are views of the caller's memory, which can also be raw RGBA pixels of a given width and height.
+struct MappedFile
+{
+    const u8*       data   = NULL;
+    size_t          size   = 0;
+    bool            mapped = false;
+    s32             width  = 0; // Only set for raw pixels.
+    s32             height = 0;
+    std::vector<u8> fallback;
+    #if defined(_WIN32)
+    HANDLE          mapping = NULL;
+    #endif
+};
+
+#if !defined(MAKEICON_NO_MAIN) || defined(MAKEICON_BENCH)
+static bool map_file(const std::string& file_name, MappedFile& file)
+{
+    std::error_code error;
+    if(!std::filesystem::is_regular_file(file_name, error))
+    {
+        return false;
+    }
+
+    #if defined(_WIN32)
+    HANDLE handle = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if(handle != INVALID_HANDLE_VALUE)
+    {
+        LARGE_INTEGER size;
+        if(GetFileSizeEx(handle, &size) && size.QuadPart > 0)
+        {
+            file.mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+            if(file.mapping)
+            {
+                file.data = CAST(const u8*, MapViewOfFile(file.mapping, FILE_MAP_READ, 0, 0, 0));
+                file.size = CAST(size_t, size.QuadPart);
+                file.mapped = (file.data != NULL);
+                if(!file.data)
+                {
+                    CloseHandle(file.mapping);
+                    file.mapping = NULL;
+                }
+            }
+        }
+        CloseHandle(handle);
+    }
+    #else
+    s32 fd = open(file_name.c_str(), O_RDONLY);
+    if(fd >= 0)
+    {
+        struct stat info;
+        if(fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            void* data = mmap(NULL, CAST(size_t, info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if(data != MAP_FAILED)
+            {
+                madvise(data, CAST(size_t, info.st_size), MADV_SEQUENTIAL);
+                file.data = CAST(const u8*, data);
+                file.size = CAST(size_t, info.st_size);
+                file.mapped = true;
+            }
+        }
+        close(fd);
+    }
+    #endif
+
+    if(!file.data)
+    {
+        file.fallback = read_entire_binary_file(file_name);
+        file.data = file.fallback.data();
+        file.size = file.fallback.size();
+    }
+    return true;
+}
+#endif
+
+static void unmap_file(MappedFile& file)
+{
+    if(file.mapped)
+    {
+        #if defined(_WIN32)
+        UnmapViewOfFile(file.data);
+        CloseHandle(file.mapping);
+        file.mapping = NULL;
+        #else
+        munmap(CAST(void*, file.data), file.size);
+        #endif
+    }
+    file.fallback.clear();
+    file.data = NULL;
+    file.size = 0;
+    file.mapped = false;
+}
+
+static bool write_entire_binary_file(const std::string& file_name, const u8* data, size_t size)
+{
+    std::ofstream file(file_name, std::ios::binary|std::ios::trunc);
+    if(!file.is_open())
+    {
+        return false;
+    }
+    file.write(CAST(const char*, data), size);
+    return file.good();
+}
+
+//
+// Output
+//
+
+struct OutputFile
+{
+    std::string     file_name;
+    std::vector<u8> data;
+};
+
+// Writes the generated files to disk, also keeping a copy of each one when the run is going to be cached. For the
+// library the files are only kept in memory and nothing is written to disk.
+struct OutputWriter
+{
+    bool                    record = false;
+    bool                    memory = false;
+    std::mutex              mutex;
+    std::vector<OutputFile> files;
+};
+
+static bool file_contents_equal(const std::string& file_name, const u8* data, size_t size)
+{
+    std::error_code error;
+    if(!std::filesystem::is_regular_file(file_name, error) || std::filesystem::file_size(file_name, error) != size)
+    {
+        return false;
+    }
+    std::vector<u8> content = read_entire_binary_file(file_name);
+    return (content.size() == size) && (size == 0 || memcmp(content.data(), data, size) == 0);
+}
+
+// Files that already exist with identical contents are left untouched so their timestamps don't change and
+// nothing downstream gets rebuilt. Safe to call from multiple threads.
+static bool write_output_file(OutputWriter& writer, const std::string& file_name, const u8* data, size_t size)
+{
+    TraceScope scope("write");
+    if(scope.trace) scope.event.detail = file_name;
+    scope.event.bytes_out = size;
+
+    if(writer.record || writer.memory)
+    {
+        OutputFile file;
+        file.file_name = file_name;
+        file.data.assign(data, data + size);
+        std::lock_guard<std::mutex> lock(writer.mutex);
+        writer.files.push_back(std::move(file));
+    }
+    if(writer.memory)
+    {
+        return true;
+    }
+    if(file_contents_equal(file_name, data, size))
+    {
+        return true;
+    }
+    return write_entire_binary_file(file_name, data, size);
+}
+
+static bool files_equal(const std::string& a, const std::string& b)
+{
+    std::error_code error;
+    if(!std::filesystem::is_regular_file(a, error) || !std::filesystem::is_regular_file(b, error))
+    {
+        return false;
+    }
+    if(std::filesystem::file_size(a, error) != std::filesystem::file_size(b, error))
+    {
+        return false;
+    }
+    std::ifstream file_a(a, std::ios::binary);
+    std::ifstream file_b(b, std::ios::binary);
+    std::vector<char> chunk_a(1 << 16), chunk_b(1 << 16);
+    while(file_a && file_b)
+    {
+        file_a.read(chunk_a.data(), chunk_a.size());
+        file_b.read(chunk_b.data(), chunk_b.size());
+        if(file_a.gcount() != file_b.gcount() || memcmp(chunk_a.data(), chunk_b.data(), CAST(size_t, file_a.gcount())) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Moves a fully written temporary file into place with a rename, so readers never see a partially written output.
+// Like write_output_file an existing file with identical contents is left untouched and the temporary is removed.
+static bool commit_output_file(OutputWriter& writer, const std::string& temp_name, const std::string& file_name)
+{
+    TraceScope scope("write");
+    if(scope.trace)
+    {
+        std::error_code error;
+        scope.event.detail = file_name;
+        scope.event.bytes_out = std::filesystem::file_size(temp_name, error);
+    }
+
+    if(writer.record)
+    {
+        OutputFile file;
+        file.file_name = file_name;
+        file.data = read_entire_binary_file(temp_name);
+        std::lock_guard<std::mutex> lock(writer.mutex);
+        writer.files.push_back(std::move(file));
+    }
+    std::error_code error;
+    if(files_equal(temp_name, file_name))
+    {
+        std::filesystem::remove(temp_name, error);
+        return true;
+    }
+    std::filesystem::rename(temp_name, file_name, error);
+    if(error)
+    {
+        std::filesystem::remove(temp_name, error);
+        return false;
+    }
+    return true;
+}
+
+#if !defined(MAKEICON_NO_MAIN) || defined(MAKEICON_BENCH)
+static void tokenize_string(const std::string& str, const char* delims, std::vector<std::string>& tokens)
+{
+    size_t prev = 0;
+    size_t pos;
+
+    while((pos = str.find_first_of(delims, prev)) != std::string::npos)
+    {
+        if(pos > prev) tokens.push_back(str.substr(prev, pos-prev));
+        prev = pos+1;
+    }
+    if(prev < str.length())
+    {
+        tokens.push_back(str.substr(prev, std::string::npos));
+    }
+}
+#endif
+
+//
+// Threading
+//
+
+// A fixed set of worker threads that each have their own task queue. Threads push the tasks they create onto their
+// own queue and take from the back of it, so nested work stays with the thread that made it, while idle threads
+// steal from the front of the other queues. Threads outside the pool share queue 0. A pool with no workers runs
+// everything inline.
+struct TaskQueue
+{
+    std::mutex                        mutex;
+    std::deque<std::function<void()>> tasks;
+};
+
+struct ThreadPool
+{
+    std::vector<std::thread>                workers;
+    std::vector<std::unique_ptr<TaskQueue>> queues;
+    std::atomic<size_t>                     queued { 0 }; // Tasks waiting in any of the queues.
+    std::mutex                              mutex;        // Guards the workers going to sleep.
+    std::condition_variable                 wake;
+    bool                                    quit = false;
+};
+
+static thread_local ThreadPool* current_pool  = NULL;
+static thread_local size_t      current_queue = 0;
+
+static TaskQueue& get_task_queue(ThreadPool& pool)
+{
+    return *pool.queues[(current_pool == &pool) ? current_queue : 0];
+}
+
+static void push_tasks(ThreadPool& pool, std::vector<std::function<void()>>& tasks)
+{
+    pool.queued += tasks.size();
+    {
+        TaskQueue& queue = get_task_queue(pool);
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        for(auto& task: tasks)
+        {
+            queue.tasks.push_back(std::move(task));
+        }
+    }
+    // Taking the lock means a worker can't miss the wake up between checking for tasks and going to sleep.
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+    }
+    pool.wake.notify_all();
+}
+
+// Takes the newest task from the calling thread's own queue, or failing that steals the oldest from another queue.
+static bool take_task(ThreadPool& pool, std::function<void()>& task)
+{
+    if(pool.queued == 0)
+    {
+        return false;
+    }
+    size_t own = (current_pool == &pool) ? current_queue : 0;
+    for(size_t i=0; i<pool.queues.size(); ++i)
+    {
+        TaskQueue& queue = *pool.queues[(own + i) % pool.queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if(!queue.tasks.empty())
+        {
+            if(i == 0)
+            {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            else
+            {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            pool.queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void thread_pool_worker(ThreadPool& pool, size_t queue)
+{
+    current_pool = &pool;
+    current_queue = queue;
+    while(true)
+    {
+        std::function<void()> task;
+        if(take_task(pool, task))
+        {
+            task();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        pool.wake.wait(lock, [&]() { return pool.quit || pool.queued > 0; });
+        if(pool.quit && pool.queued == 0) return;
+    }
+}
+
+static void init_thread_pool(ThreadPool& pool, s32 thread_count)
+{
+    if(thread_count <= 0)
+    {
+        thread_count = CAST(s32, std::thread::hardware_concurrency());
+    }
+    // The calling thread also executes tasks while it waits, so we only need count-1 extra workers.
+    pool.queues.emplace_back(std::make_unique<TaskQueue>());
+    for(s32 i=1; i<thread_count; ++i)
+    {
+        pool.queues.emplace_back(std::make_unique<TaskQueue>());
+    }
+    for(s32 i=1; i<thread_count; ++i)
+    {
+        pool.workers.emplace_back(thread_pool_worker, std::ref(pool), CAST(size_t, i));
+    }
+}
+
+static void quit_thread_pool(ThreadPool& pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.quit = true;
+    }
+    pool.wake.notify_all();
+    for(auto& worker: pool.workers)
+    {
+        worker.join();
+    }
+    pool.workers.clear();
+}
+
+// Runs func(0) ... func(count-1) across the pool and returns once every call has completed. The calling
+// thread helps drain the queue while it waits, which also makes it safe to call this from inside a task. If any
+// call throws, the first exception is rethrown on the calling thread once every call has finished.
+static void parallel_for(ThreadPool& pool, size_t count, const std::function<void(size_t)>& func)
+{
+    if(pool.workers.empty() || count <= 1)
+    {
+        for(size_t i=0; i<count; ++i) func(i);
+        return;
+    }
+
+    std::mutex              done_mutex;
+    std::condition_variable done;
+    size_t                  remaining = count;
+    std::exception_ptr      failure;
+    Trace*                  trace = current_trace;
+
+    std::vector<std::function<void()>> tasks;
+    tasks.reserve(count);
+    for(size_t i=0; i<count; ++i)
+    {
+        tasks.push_back([&, i]()
+        {
+            // Workers record to the trace of whoever queued the task.
+            Trace* previous = current_trace;
+            current_trace = trace;
+            std::exception_ptr exception;
+            try
+            {
+                func(i);
+            }
+            catch(...)
+            {
+                exception = std::current_exception();
+            }
+            current_trace = previous;
+            std::lock_guard<std::mutex> done_lock(done_mutex);
+            if(exception && !failure) failure = exception;
+            if(--remaining == 0) done.notify_all();
+        });
+    }
+    // Pushed in reverse so that taking from the back of our own queue runs them in order.
+    std::reverse(tasks.begin(), tasks.end());
+    push_tasks(pool, tasks);
+
+    std::function<void()> task;
+    while(take_task(pool, task))
+    {
+        task();
+        task = nullptr;
+        std::lock_guard<std::mutex> done_lock(done_mutex);
+        if(remaining == 0) break;
+    }
+
+    std::unique_lock<std::mutex> done_lock(done_mutex);
+    done.wait(done_lock, [&]() { return remaining == 0; });
+    if(failure)
+    {
+        std::rethrow_exception(failure);
+    }
+}
+
+//
+// Image Cache
+//
+
+// In batch mode the jobs share the images they decode and render. Each input path is decoded once by whichever job
+// needs it first and every icon rendered from it is kept alongside, keyed by its size and modifiers, so other jobs
+// that ask for the same icon get it without rendering it again. The encoded bytes of each icon are kept as well, so
+// a job that encodes it the same way doesn't encode it again. Cascaded icons are the exception as they depend on
+// the other sizes of their job. Every source counts the jobs that list it and its
+// images are freed as soon as the last of those jobs has finished.
+struct RenderSettings
+{
+    s32  size    = 0;
+    f32  padding = 0.0f;
+    f32  radius  = 0.0f;
+    bool linear  = false;
+
+    inline bool operator<(const RenderSettings& rhs) const
+    {
+        return std::tie(size, padding, radius, linear) < std::tie(rhs.size, rhs.padding, rhs.radius, rhs.linear);
+    }
+};
+
+// An icon is also kept encoded, keyed by its render settings and how it was encoded.
+struct EncodeSettings
+{
+    RenderSettings render;
+    Compression    compression = Compression_Default;
+    IcoFormat      format      = IcoFormat_Png; // Only .ico entries are ever stored as anything but a PNG.
+
+    inline bool operator<(const EncodeSettings& rhs) const
+    {
+        return std::tie(render, compression, format) < std::tie(rhs.render, rhs.compression, rhs.format);
+    }
+};
+
+struct SharedSource
+{
+    s32                                       users   = 0; // Jobs that have not finished with the source yet.
+    bool                                      loading = false;
+    Image                                     image;
+    std::map<RenderSettings, Image>           renders;
+    std::map<EncodeSettings, std::vector<u8>> encodings;
+};
+
+struct ImageCache
+{
+    std::mutex                          mutex;
+    std::condition_variable             loaded;
+    std::map<std::string, SharedSource> sources;
+};
+
+// Paths are normalized so that the same file is shared however each job refers to it.
+static std::string get_shared_source_name(const std::string& file_name)
+{
+    std::error_code error;
+    std::filesystem::path path = std::filesystem::absolute(file_name, error);
+    return ((error) ? std::filesystem::path(file_name) : path).lexically_normal().string();
+}
+
+// Sources are only retired by the manifest, watch and server modes of the command line program.
+#ifndef MAKEICON_NO_MAIN
+// Registers a job as a user of each of the paths, which must be done for every job before any of them run.
+static void add_shared_source_users(ImageCache& cache, const std::vector<std::string>& file_names)
+{
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    for(auto& file_name: file_names)
+    {
+        cache.sources[get_shared_source_name(file_name)].users++;
+    }
+}
+
+static void free_shared_source(SharedSource& source)
+{
+    free_image(source.image);
+    for(auto& render: source.renders)
+    {
+        free_image(render.second);
+    }
+    source.renders.clear();
+    source.encodings.clear();
+}
+
+static void release_shared_sources(ImageCache& cache, const std::vector<std::string>& file_names)
+{
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    for(auto& file_name: file_names)
+    {
+        auto it = cache.sources.find(get_shared_source_name(file_name));
+        if(it == cache.sources.end() || --it->second.users > 0)
+        {
+            continue;
+        }
+        free_shared_source(it->second);
+        cache.sources.erase(it);
+    }
+}
+
+// Drops everything decoded, rendered and encoded from a source so the next job that uses it starts from the file
+// again. Watch mode calls this between runs for the files that changed, so no job can be using the source.
+static void evict_shared_source(ImageCache& cache, const std::string& file_name)
+{
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto it = cache.sources.find(get_shared_source_name(file_name));
+    if(it != cache.sources.end())
+    {
+        free_shared_source(it->second);
+        cache.sources.erase(it);
+    }
+}
+#endif // MAKEICON_NO_MAIN
+
+// Returns the decoded image for the path, calling decode to produce it if no job has yet. If another job is already
+// decoding it this waits for that job to finish rather than decoding it twice. The image belongs to the cache.
+static Image acquire_shared_source(ImageCache& cache, const std::string& file_name, const std::function<Image()>& decode)
+{
+    std::unique_lock<std::mutex> lock(cache.mutex);
+    SharedSource& source = cache.sources[get_shared_source_name(file_name)];
+    cache.loaded.wait(lock, [&]() { return !source.loading; });
+    if(source.image.data)
+    {
+        return source.image;
+    }
+    source.loading = true;
+    lock.unlock();
+
+    Image image;
+    try
+    {
+        image = decode();
+    }
+    catch(...)
+    {
+        lock.lock();
+        source.loading = false;
+        cache.loaded.notify_all();
+        throw;
+    }
+
+    lock.lock();
+    source.image = image;
+    source.loading = false;
+    cache.loaded.notify_all();
+    return image;
+}
+
+// State shared by everything that runs as part of a single makeicon invocation. In batch mode every job has its own
+// context but they all share the pool and the image cache.
+struct Context
+{
+    ThreadPool&              pool;
+    OutputWriter             writer;
+    ImageCache*              cache = NULL;
+    std::vector<std::string> image_paths; // The file each of the loaded input images came from, in the same order.
+    explicit Context(ThreadPool& thread_pool): pool(thread_pool) {}
+};
+
+//
+// Streaming PNG Decoding
+//
+
+// Very large masters are never decoded whole. When a PNG source is only ever downsampled it is inflated and
+// unfiltered a band of rows at a time while it is being resized, so the memory it needs depends on its width and
+// the band height rather than on its area. Only the formats stb_image would decode identically are streamed: non
+// interlaced, 8 or 16 bits per channel, or a palette. Anything else is decoded up front as usual.
+
+static constexpr s64 STREAM_SOURCE_PIXELS = 4096 * 4096; // Sources with at least this many pixels are streamed.
+static constexpr s32 INFLATE_FAST_BITS    = 9;
+static constexpr s32 INFLATE_WINDOW       = 32768;
+
+struct InflateHuffman
+{
+    u16 fast[1 << INFLATE_FAST_BITS]; // (length << 9) | symbol for codes that fit in the table, 0 otherwise.
+    u16 counts[16];                   // Number of codes of each length.
+    u16 symbols[288];                 // Symbols ordered by code.
+};
+
+// An inflater that can be stopped and resumed at any symbol, reading the zlib stream across every IDAT chunk.
+struct InflateStream
+{
+    const u8*       data      = NULL; // The whole PNG file.
+    size_t          size      = 0;
+    size_t          pos       = 0;    // Position in the current IDAT chunk.
+    size_t          chunk_end = 0;
+    u64             bits      = 0;
+    s32             bit_count = 0;
+    bool            final     = false;
+    bool            in_block  = false;
+    s32             type      = 0;
+    u32             stored    = 0; // Bytes left in a stored block.
+    InflateHuffman  lit;
+    InflateHuffman  dist;
+    std::vector<u8> out;      // Inflated bytes, kept back to the start of the window.
+    size_t          read = 0; // Bytes of `out` that have been consumed.
+};
+
+struct PngStream
+{
+    std::string     name;
+    InflateStream   inflate;
+    s32             width       = 0;
+    s32             height      = 0;
+    s32             bit_depth   = 0;
+    s32             color_type  = 0;
+    s32             pixel_bytes = 0; // Bytes per pixel, the distance filters look back by.
+    size_t          row_bytes   = 0;
+    u8              palette[256*4];
+    bool            has_key     = false; // tRNS colour key for grey and RGB images.
+    u16             key[3]      = {};
+    std::vector<u8> previous;
+    std::vector<u8> current;
+};
+
+static inline u32 read_u32_be(const u8* p)
+{
+    return (CAST(u32, p[0]) << 24) | (CAST(u32, p[1]) << 16) | (CAST(u32, p[2]) << 8) | p[3];
+}
+
+static void build_inflate_huffman(InflateHuffman& huffman, const u8* lengths, s32 count)
+{
+    memset(&huffman, 0, sizeof(huffman));
+    for(s32 i=0; i<count; ++i) huffman.counts[lengths[i]]++;
+    huffman.counts[0] = 0;
+
+    u16 offsets[16] = {};
+    for(s32 len=1; len<15; ++len) offsets[len+1] = offsets[len] + huffman.counts[len];
+    for(s32 i=0; i<count; ++i)
+    {
+        if(lengths[i]) huffman.symbols[offsets[lengths[i]]++] = CAST(u16, i);
+    }
+
+    u16 codes[288];
+    build_huffman_codes(lengths, count, codes);
+    for(s32 i=0; i<count; ++i)
+    {
+        if(!lengths[i] || lengths[i] > INFLATE_FAST_BITS) continue;
+        for(u32 j=codes[i]; j<(1u << INFLATE_FAST_BITS); j+=(1u << lengths[i]))
+        {
+            huffman.fast[j] = CAST(u16, (lengths[i] << 9) | i);
+        }
+    }
+}
+
+// Tops the bit buffer up to at least `count` bits, returns false if the compressed data runs out first.
+static bool fill_inflate_bits(InflateStream& stream, s32 count)
+{
+    while(stream.bit_count < count)
+    {
+        // Move on to the next chunk, skipping the CRC of the current one, the data must continue in an IDAT.
+        while(stream.pos == stream.chunk_end)
+        {
+            size_t next = stream.chunk_end + 4;
+            if(next + 8 > stream.size || memcmp(stream.data + next + 4, "IDAT", 4) != 0)
+            {
+                return false;
+            }
+            stream.pos = next + 8;
+            stream.chunk_end = stream.pos + read_u32_be(stream.data + next);
+            if(stream.chunk_end > stream.size) return false;
+        }
+        stream.bits |= CAST(u64, stream.data[stream.pos++]) << stream.bit_count;
+        stream.bit_count += 8;
+    }
+    return true;
+}
+
+static u32 read_inflate_bits(InflateStream& stream, s32 count, const PngStream& png)
+{
+    if(!fill_inflate_bits(stream, count))
+    {
+        FAIL(MakeIconError_InvalidInput, "Failed to load input image: %s", png.name.c_str());
+    }
+    u32 value = CAST(u32, stream.bits & ((1ull << count) - 1));
+    stream.bits >>= count;
+    stream.bit_count -= count;
+    return value;
+}
+
+static s32 decode_inflate_symbol(InflateStream& stream, const InflateHuffman& huffman, const PngStream& png)
+{
+    fill_inflate_bits(stream, 15); // The stream may legitimately end with fewer bits than this.
+    u16 entry = huffman.fast[stream.bits & ((1u << INFLATE_FAST_BITS) - 1)];
+    if(entry && (entry >> 9) <= stream.bit_count)
+    {
+        stream.bits >>= (entry >> 9);
+        stream.bit_count -= (entry >> 9);
+        return entry & 511;
+    }
+
+    // Codes longer than the table are decoded a bit at a time.
+    s32 code = 0, first = 0, index = 0;
+    for(s32 len=1; len<16; ++len)
+    {
+        code |= read_inflate_bits(stream, 1, png);
+        s32 count = huffman.counts[len];
+        if(code - count < first)
+        {
+            return huffman.symbols[index + (code - first)];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    FAIL(MakeIconError_InvalidInput, "Failed to load input image: %s", png.name.c_str());
+}
+
+static void begin_inflate_block(InflateStream& stream, const PngStream& png)
+{
+    stream.final = read_inflate_bits(stream, 1, png);
+    stream.type = read_inflate_bits(stream, 2, png);
+    if(stream.type == 0)
+    {
+        read_inflate_bits(stream, stream.bit_count & 7, png); // Stored blocks start on a byte boundary.
+        u32 len = read_inflate_bits(stream, 16, png);
+        u32 nlen = read_inflate_bits(stream, 16, png);
+        if((len ^ 0xFFFF) != nlen)
+        {
+            FAIL(MakeIconError_InvalidInput, "Failed to load input image: %s", png.name.c_str());
+        }
+        stream.stored = len;
+    }
+    else if(stream.type == 1)
+    {
+        u8 lengths[288+32];
+        for(s32 i=0; i<288; ++i) lengths[i] = (i < 144) ? 8 : (i < 256) ? 9 : (i < 280) ? 7 : 8;
+        for(s32 i=0; i<30; ++i) lengths[288+i] = 5;
+        build_inflate_huffman(stream.lit, lengths, 288);
+        build_inflate_huffman(stream.dist, lengths+288, 30);
+    }
+    else if(stream.type == 2)
+    {
+        static constexpr u8 ORDER[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+        s32 hlit = read_inflate_bits(stream, 5, png) + 257;
+        s32 hdist = read_inflate_bits(stream, 5, png) + 1;
+        s32 hclen = read_inflate_bits(stream, 4, png) + 4;
+        u8 code_lengths[19] = {};
+        for(s32 i=0; i<hclen; ++i) code_lengths[ORDER[i]] = CAST(u8, read_inflate_bits(stream, 3, png));
+        InflateHuffman codes;
+        build_inflate_huffman(codes, code_lengths, 19);
+
+        u8 lengths[288+32] = {};
+        for(s32 n=0; n<hlit+hdist;)
+        {
+            s32 symbol = decode_inflate_symbol(stream, codes, png);
+            s32 repeat = 1;
+            u8 value = CAST(u8, symbol);
+            if(symbol == 16)
+            {
+                if(n == 0) FAIL(MakeIconError_InvalidInput, "Failed to load input image: %s", png.name.c_str());
+                value = lengths[n-1];
+                repeat = 3 + read_inflate_bits(stream, 2, png);
+            }
+            else if(symbol == 17) { value = 0; repeat = 3 + read_inflate_bits(stream, 3, png); }
+            else if(symbol == 18) { value = 0; repeat = 11 + read_inflate_bits(stream, 7, png); }
+            if(n + repeat > hlit + hdist)
+            {
+                FAIL(MakeIconError_InvalidInput, "Failed to load input image: %s", png.name.c_str());
+            }
+            while(repeat--) lengths[n++] = value;
+        }
+        // The distance lengths are moved so that both tables are built from the start of an array.
+        u8 dist_lengths[32] = {};
+        memcpy(dist_lengths, lengths + hlit, hdist);
+        build_inflate_huffman(stream.lit, lengths, hlit);
+        build_inflate_huffman(stream.dist, dist_lengths, hdist);
+    }
+    else
+    {
+        FAIL(MakeIconError_InvalidInput, "Failed to load input image: %s", png.name.c_str());
+    }
+    stream.in_block = true;
+}
+
+// Inflates until there are at least `count` unread bytes, the bytes are available from out[read].
+static void inflate_bytes(InflateStream& stream, size_t count, const PngStream& png)
+{
+    // Drop everything that is no longer reachable by a match so the buffer stays the size of the window.
+    if(stream.read > 4 * INFLATE_WINDOW)
+    {
+        size_t drop = stream.read - INFLATE_WINDOW;
+        stream.out.erase(stream.out.begin(), stream.out.begin() + drop);
+        stream.read -= drop;
+    }
+
+    while(stream.out.size() - stream.read < count)
+    {
+        if(!stream.in_block)
+        {
+            if(stream.final)
+            {
+                FAIL(MakeIconError_InvalidInput, "Failed to load input image: %s", png.name.c_str());
+            }
+            begin_inflate_block(stream, png);
+        }
+        if(stream.type == 0)
+        {
+            if(stream.stored == 0)
+            {
+                stream.in_block = false;
+                continue;
+            }
+            stream.out.push_back(CAST(u8, read_inflate_bits(stream, 8, png)));
+            stream.stored--;
+            continue;
+        }
+
+        s32 symbol = decode_inflate_symbol(stream, stream.lit, png);
+        if(symbol < 256)
+        {
+            stream.out.push_back(CAST(u8, symbol));
+        }
+        else if(symbol == 256)
+        {
+            stream.in_block = false;
+        }
+        else
+        {
+            symbol -= 257;
+            if(symbol >= 29) FAIL(MakeIconError_InvalidInput, "Failed to load input image: %s", png.name.c_str());
+            s32 len = DEFLATE_LENGTH_BASE[symbol] + read_inflate_bits(stream, DEFLATE_LENGTH_EXTRA[symbol], png);
+            s32 dist_symbol = decode_inflate_symbol(stream, stream.dist, png);
+            if(dist_symbol >= 30) FAIL(MakeIconError_InvalidInput, "Failed to load input image: %s", png.name.c_str());
+            size_t dist = DEFLATE_DIST_BASE[dist_symbol] + read_inflate_bits(stream, DEFLATE_DIST_EXTRA[dist_symbol], png);
+            if(dist > stream.out.size()) FAIL(MakeIconError_InvalidInput, "Failed to load input image: %s", png.name.c_str());
+            size_t from = stream.out.size() - dist;
+            for(s32 i=0; i<len; ++i)
+            {
+                stream.out.push_back(stream.out[from + i]);
+            }
+        }
+    }
+}
+
+// Reads the header and every chunk up to the image data, returns false if the file is not a PNG that can be streamed.
+static bool open_png_stream(const u8* data, size_t size, const std::string& name, PngStream& png)
+{
+    static constexpr u8 SIGNATURE[8] = { 0x89,'P','N','G','\r','\n',0x1A,'\n' };
+    if(size < 8+25 || memcmp(data, SIGNATURE, 8) != 0 || memcmp(data + 12, "IHDR", 4) != 0)
+    {
+        return false;
+    }
+    const u8* header = data + 16;
+    png.name = name;
+    png.width = CAST(s32, read_u32_be(header));
+    png.height = CAST(s32, read_u32_be(header + 4));
+    png.bit_depth = header[8];
+    png.color_type = header[9];
+    if(header[12] != 0 || png.width <= 0 || png.height <= 0) return false; // Interlaced.
+
+    s32 channels = 0;
+    switch(png.color_type)
+    {
+        case 0: channels = 1; break;
+        case 2: channels = 3; break;
+        case 3: channels = 1; break;
+        case 4: channels = 2; break;
+        case 6: channels = 4; break;
+        default: return false;
+    }
+    if((png.color_type == 3) ? (png.bit_depth != 8) : (png.bit_depth != 8 && png.bit_depth != 16)) return false;
+    png.pixel_bytes = channels * (png.bit_depth / 8);
+    png.row_bytes = CAST(size_t, png.width) * png.pixel_bytes;
+
+    // Palette entries are opaque unless tRNS says otherwise.
+    for(s32 i=0; i<256; ++i)
+    {
+        png.palette[i*4+0] = png.palette[i*4+1] = png.palette[i*4+2] = 0;
+        png.palette[i*4+3] = 255;
+    }
+
+    size_t pos = 8;
+    while(pos + 12 <= size)
+    {
+        u32 length = read_u32_be(data + pos);
+        const u8* type = data + pos + 4;
+        const u8* chunk = data + pos + 8;
+        if(pos + 12 + CAST(size_t, length) > size) return false;
+        if(memcmp(type, "CgBI", 4) == 0)
+        {
+            return false; // Apple's premultiplied BGR variant.
+        }
+        if(memcmp(type, "PLTE", 4) == 0)
+        {
+            for(u32 i=0; i<length/3 && i<256; ++i)
+            {
+                memcpy(png.palette + i*4, chunk + i*3, 3);
+            }
+        }
+        else if(memcmp(type, "tRNS", 4) == 0)
+        {
+            if(png.color_type == 3)
+            {
+                for(u32 i=0; i<length && i<256; ++i) png.palette[i*4+3] = chunk[i];
+            }
+            else if(png.color_type == 0 && length >= 2)
+            {
+                png.has_key = true;
+                png.key[0] = CAST(u16, (chunk[0] << 8) | chunk[1]);
+            }
+            else if(png.color_type == 2 && length >= 6)
+            {
+                png.has_key = true;
+                for(s32 i=0; i<3; ++i) png.key[i] = CAST(u16, (chunk[i*2] << 8) | chunk[i*2+1]);
+            }
+        }
+        else if(memcmp(type, "IDAT", 4) == 0)
+        {
+            png.inflate.data = data;
+            png.inflate.size = size;
+            png.inflate.pos = pos + 8;
+            png.inflate.chunk_end = pos + 8 + length;
+            // Skip the zlib header, a preset dictionary is never used in a PNG.
+            InflateStream& stream = png.inflate;
+            if(!fill_inflate_bits(stream, 16) || (stream.bits & 0x0F) != 8 || (stream.bits & 0x2000) || ((stream.bits & 0xFF) * 256 + ((stream.bits >> 8) & 0xFF)) % 31 != 0)
+            {
+                return false;
+            }
+            stream.bits >>= 16;
+            stream.bit_count -= 16;
+            png.previous.assign(png.row_bytes, 0);
+            png.current.resize(png.row_bytes);
+            return true;
+        }
+        pos += 12 + CAST(size_t, length);
+    }
+    return false;
+}
+
+// Inflates and unfilters the next row and converts it to 8-bit RGBA the same way stb_image does.
+static void read_png_stream_row(PngStream& png, u8* rgba)
+{
+    InflateStream& stream = png.inflate;
+    inflate_bytes(stream, png.row_bytes + 1, png);
+    s32 filter = stream.out[stream.read];
+    const u8* src = stream.out.data() + stream.read + 1;
+    stream.read += png.row_bytes + 1;
+
+    u8* row = png.current.data();
+    const u8* prev = png.previous.data();
+    s32 bpp = png.pixel_bytes;
+    for(size_t i=0; i<png.row_bytes; ++i)
+    {
+        s32 a = (i >= CAST(size_t, bpp)) ? row[i-bpp] : 0;
+        s32 b = prev[i];
+        s32 c = (i >= CAST(size_t, bpp)) ? prev[i-bpp] : 0;
+        switch(filter)
+        {
+            case 0: row[i] = src[i]; break;
+            case 1: row[i] = CAST(u8, src[i] + a); break;
+            case 2: row[i] = CAST(u8, src[i] + b); break;
+            case 3: row[i] = CAST(u8, src[i] + ((a + b) >> 1)); break;
+            case 4: row[i] = CAST(u8, src[i] + png_paeth(a, b, c)); break;
+            default: FAIL(MakeIconError_InvalidInput, "Failed to load input image: %s", png.name.c_str());
+        }
+    }
+
+    // 16-bit samples are reduced to their high byte, colour keys are compared at the full depth.
+    s32 step = png.bit_depth / 8;
+    auto sample = [&](const u8* p) { return (step == 2) ? CAST(u16, (p[0] << 8) | p[1]) : CAST(u16, p[0]); };
+    const u8* p = row;
+    for(s32 x=0; x<png.width; ++x, rgba+=4)
+    {
+        switch(png.color_type)
+        {
+            case 0:
+            {
+                rgba[0] = rgba[1] = rgba[2] = p[0];
+                rgba[3] = (png.has_key && sample(p) == png.key[0]) ? 0 : 255;
+                p += step;
+            } break;
+            case 2:
+            {
+                rgba[0] = p[0];
+                rgba[1] = p[step];
+                rgba[2] = p[step*2];
+                rgba[3] = (png.has_key && sample(p) == png.key[0] && sample(p+step) == png.key[1] && sample(p+step*2) == png.key[2]) ? 0 : 255;
+                p += step * 3;
+            } break;
+            case 3:
+            {
+                memcpy(rgba, png.palette + p[0]*4, 4);
+                p += 1;
+            } break;
+            case 4:
+            {
+                rgba[0] = rgba[1] = rgba[2] = p[0];
+                rgba[3] = p[step];
+                p += step * 2;
+            } break;
+            case 6:
+            {
+                rgba[0] = p[0];
+                rgba[1] = p[step];
+                rgba[2] = p[step*2];
+                rgba[3] = p[step*3];
+                p += step * 4;
+            } break;
+        }
+    }
+    png.previous.swap(png.current);
+}
+
+//
+// Multi-target Resampling
+//
+
+// Downsamples one source to several sizes while only walking the source once. The source is decoded to premultiplied
+// linear light a band of rows at a time, and every target filters those rows horizontally and adds them into its own
+// vertical accumulators, with the targets running in parallel. This is the same Mitchell filter, sRGB handling and
+// edge clamping that stbir_resize_uint8_srgb uses when downsampling, so the results match within rounding.
+
+static constexpr s32 RESAMPLE_BAND_ROWS = 32;
+
+// The weights each output pixel along one axis takes from the input pixels, with out of range inputs clamped to the edge.
+struct ResampleAxis
+{
+    std::vector<s32> first;   // First input pixel of each output pixel.
+    std::vector<s32> count;   // Number of input pixels each output pixel reads.
+    std::vector<u32> offset;  // Where each output pixel's weights start.
+    std::vector<f32> weights;
+};
+
+static void build_resample_axis(s32 input_size, s32 output_size, ResampleAxis& axis)
+{
+    f32 scale = CAST(f32, output_size) / input_size;
+    f32 radius = 2.0f / scale; // The Mitchell filter has a support of two output pixels.
+    for(s32 o=0; o<output_size; ++o)
+    {
+        f32 center = (o + 0.5f) / scale;
+        s32 lo = CAST(s32, floorf(center - radius - 0.5f));
+        s32 hi = CAST(s32, ceilf(center + radius - 0.5f));
+        s32 first = std::clamp(lo, 0, input_size-1);
+        s32 last = std::clamp(hi, 0, input_size-1);
+        u32 offset = CAST(u32, axis.weights.size());
+        axis.weights.resize(offset + (last - first + 1), 0.0f);
+        f32 total = 0.0f;
+        for(s32 i=lo; i<=hi; ++i)
+        {
+            f32 weight = stbir__filter_mitchell(((i + 0.5f) - center) * scale, scale);
+            axis.weights[offset + std::clamp(i, 0, input_size-1) - first] += weight;
+            total += weight;
+        }
+        for(u32 i=offset; i<axis.weights.size(); ++i)
+        {
+            axis.weights[i] /= total;
+        }
+        axis.first.push_back(first);
+        axis.count.push_back(last - first + 1);
+        axis.offset.push_back(offset);
+    }
+}
+
+struct ResampleTarget
+{
+    s32              size = 0;
+    ResampleAxis     horizontal;
+    ResampleAxis     vertical;
+    std::vector<s32> first_row; // For each source row, the first output row that reads it.
+    std::vector<s32> last_row;  // For each source row, the last output row that reads it.
+    std::vector<f32> row;       // One horizontally filtered row.
+    std::vector<f32> accum;     // Every output row, premultiplied linear light.
+};
+
+// Converts one row to premultiplied linear light, the same way stb does before resampling.
+static void decode_resample_row(const u8* src, s32 width, f32* dst)
+{
+    for(s32 x=0; x<width; ++x, src+=4, dst+=4)
+    {
+        f32 alpha = src[3] / 255.0f + STBIR_ALPHA_EPSILON; // Stops fully transparent pixels losing their colour.
+        dst[0] = stbir__srgb_uchar_to_linear_float[src[0]] * alpha;
+        dst[1] = stbir__srgb_uchar_to_linear_float[src[1]] * alpha;
+        dst[2] = stbir__srgb_uchar_to_linear_float[src[2]] * alpha;
+        dst[3] = alpha;
+    }
+}
+
+// Adds source row `y`, already decoded, into the target's accumulators.
+static void accumulate_resample_row(ResampleTarget& target, const f32* decoded, s32 y)
+{
+    const ResampleAxis& h = target.horizontal;
+    const ResampleAxis& v = target.vertical;
+
+    s32 first_row = target.first_row[y];
+    s32 last_row = target.last_row[y];
+    if(first_row > last_row)
+    {
+        return;
+    }
+
+    f32* row = target.row.data();
+    for(s32 x=0; x<target.size; ++x)
+    {
+        const f32* src = decoded + h.first[x] * 4;
+        const f32* weights = h.weights.data() + h.offset[x];
+        f32 r = 0.0f, g = 0.0f, b = 0.0f, a = 0.0f;
+        for(s32 i=0; i<h.count[x]; ++i, src+=4)
+        {
+            r += src[0] * weights[i];
+            g += src[1] * weights[i];
+            b += src[2] * weights[i];
+            a += src[3] * weights[i];
+        }
+        row[x*4+0] = r;
+        row[x*4+1] = g;
+        row[x*4+2] = b;
+        row[x*4+3] = a;
+    }
+
+    for(s32 o=first_row; o<=last_row; ++o)
+    {
+        f32 weight = v.weights[v.offset[o] + (y - v.first[o])];
+        f32* dst = target.accum.data() + CAST(size_t, o) * target.size * 4;
+        for(s32 i=0; i<target.size*4; ++i)
+        {
+            dst[i] += row[i] * weight;
+        }
+    }
+}
+
+static void encode_resample_target(const ResampleTarget& target, u8* output)
+{
+    const f32* src = target.accum.data();
+    for(size_t i=0, count=CAST(size_t, target.size)*target.size; i<count; ++i, src+=4, output+=4)
+    {
+        f32 alpha = src[3];
+        f32 reciprocal_alpha = (alpha) ? 1.0f / alpha : 0.0f;
+        output[0] = stbir__linear_to_srgb_uchar(src[0] * reciprocal_alpha);
+        output[1] = stbir__linear_to_srgb_uchar(src[1] * reciprocal_alpha);
+        output[2] = stbir__linear_to_srgb_uchar(src[2] * reciprocal_alpha);
+        output[3] = CAST(u8, std::clamp(alpha, 0.0f, 1.0f) * 255.0f + 0.5f);
+    }
+}
+
+// Downsamples a square RGBA source to every one of the sizes, which must all be smaller than the source. Returns
+// false if allocation fails, otherwise outputs[i] holds the image for sizes[i]. A streamed source is decoded a band
+// at a time, with the next band being decoded while the targets accumulate the current one.
+static bool resize_image_multi(const Image& source, const std::vector<s32>& sizes, const std::string& name, ThreadPool& pool, std::vector<Image>& outputs)
+{
+    assert(source.bpp == 4); // Images are always decoded as RGBA.
+
+    TraceScope scope("resize");
+    scope.event.bytes_in = CAST(u64, source.width) * source.height * 4;
+    for(auto size: sizes)
+    {
+        scope.event.pixels += CAST(u64, size) * size;
+    }
+    scope.event.bytes_out = scope.event.pixels * 4;
+
+    std::vector<ResampleTarget> targets(sizes.size());
+    outputs.assign(sizes.size(), Image());
+    for(size_t t=0; t<sizes.size(); ++t)
+    {
+        ResampleTarget& target = targets[t];
+        target.size = sizes[t];
+        build_resample_axis(source.width, target.size, target.horizontal);
+        build_resample_axis(source.height, target.size, target.vertical);
+        // The output rows whose support includes a source row are always a contiguous range.
+        target.first_row.assign(source.height, target.size);
+        target.last_row.assign(source.height, -1);
+        for(s32 o=0; o<target.size; ++o)
+        {
+            for(s32 y=target.vertical.first[o]; y<target.vertical.first[o]+target.vertical.count[o]; ++y)
+            {
+                target.first_row[y] = std::min(target.first_row[y], o);
+                target.last_row[y] = std::max(target.last_row[y], o);
+            }
+        }
+        target.row.resize(CAST(size_t, target.size) * 4);
+        target.accum.assign(CAST(size_t, target.size) * target.size * 4, 0.0f);
+
+        outputs[t].width = target.size;
+        outputs[t].height = target.size;
+        outputs[t].bpp = 4;
+        outputs[t].data = CAST(u8*, malloc(CAST(size_t, target.size) * target.size * 4));
+        if(!outputs[t].data)
+        {
+            for(auto& output: outputs) free_image(output);
+            return false;
+        }
+    }
+
+    size_t row_size = CAST(size_t, source.width) * 4;
+    std::unique_ptr<PngStream> stream;
+    std::vector<u8> pixels[2]; // Double buffered bands of a streamed source.
+    auto read_band = [&](s32 start, std::vector<u8>& band_pixels)
+    {
+        s32 rows = std::min(RESAMPLE_BAND_ROWS, source.height - start);
+        for(s32 r=0; r<rows; ++r)
+        {
+            read_png_stream_row(*stream, band_pixels.data() + r * row_size);
+        }
+    };
+
+    try
+    {
+        if(!source.data)
+        {
+            stream = std::make_unique<PngStream>();
+            if(!open_png_stream(source.encoded, source.encoded_size, name, *stream))
+            {
+                FAIL(MakeIconError_InvalidInput, "Failed to load input image: %s", name.c_str());
+            }
+            for(auto& band_pixels: pixels) band_pixels.resize(RESAMPLE_BAND_ROWS * row_size);
+            read_band(0, pixels[0]);
+        }
+
+        std::vector<f32> band(CAST(size_t, RESAMPLE_BAND_ROWS) * source.width * 4);
+        for(s32 start=0, b=0; start<source.height; start+=RESAMPLE_BAND_ROWS, b^=1)
+        {
+            s32 rows = std::min(RESAMPLE_BAND_ROWS, source.height - start);
+            const u8* band_pixels = (stream) ? pixels[b].data() : source.data + start * row_size;
+            parallel_for(pool, rows, [&](size_t r)
+            {
+                decode_resample_row(band_pixels + r * row_size, source.width, band.data() + r * source.width * 4);
+            });
+            // The last task reads the next band of a streamed source, it can't be split so it overlaps the targets instead.
+            parallel_for(pool, targets.size() + 1, [&](size_t t)
+            {
+                if(t == targets.size())
+                {
+                    if(stream && start + RESAMPLE_BAND_ROWS < source.height) read_band(start + RESAMPLE_BAND_ROWS, pixels[b^1]);
+                    return;
+                }
+                for(s32 r=0; r<rows; ++r)
+                {
+                    accumulate_resample_row(targets[t], band.data() + CAST(size_t, r) * source.width * 4, start + r);
+                }
+            });
+        }
+    }
+    catch(...)
+    {
+        for(auto& output: outputs) free_image(output);
+        throw;
+    }
+
+    parallel_for(pool, targets.size(), [&](size_t t)
+    {
+        encode_resample_target(targets[t], outputs[t].data);
+    });
+    return true;
+}
+
+// A unique combination of source image, pixel size and modifiers, each one only needs to be rendered and encoded
+// once no matter how many outputs it is written to.
+struct RenderKey
+{
+    s32 source  = -1;
+    s32 size    = 0;
+    f32 padding = 0.0f;
+    f32 radius  = 0.0f;
+
+    inline bool operator<(const RenderKey& rhs) const
+    {
+        if(source != rhs.source) return (source < rhs.source);
+        if(size != rhs.size) return (size < rhs.size);
+        if(padding != rhs.padding) return (padding < rhs.padding);
+        return (radius < rhs.radius);
+    }
+};
+
+// Maps a list of requested sizes onto the unique renders needed to produce them.
+struct RenderPlan
+{
+    std::vector<RenderKey> keys;    // The unique renders, in the order they were first requested.
+    std::vector<size_t>    outputs; // For each requested size, the index of the key that produces it.
+};
+
+static void plan_renders(const Options& options, const std::vector<Image>& input_images, const std::vector<s32>& sizes, bool resize, RenderPlan& plan)
+{
+    std::map<RenderKey, size_t> lookup;
+    for(auto size: sizes)
+    {
+        RenderKey key;
+        key.source = find_source_image(input_images, size, resize);
+        key.size = size;
+        key.padding = options.padding;
+        key.radius = options.radius;
+        if(key.source < 0)
+        {
+            // If no match was found and resize wasn't specified then we fail.
+            FAIL(MakeIconError_MissingSize, "Size %d was requested but no input image of this size was provided! Potentially specify -resize to allow for reszing to this size.", size);
+        }
+
+        auto it = lookup.find(key);
+        if(it == lookup.end())
+        {
+            it = lookup.emplace(key, plan.keys.size()).first;
+            plan.keys.push_back(key);
+        }
+        plan.outputs.push_back(it->second);
+    }
+}
+
+// Produces an image for every key and passes it to emit(k, image) along with the index of the key, the image is
+// only valid for the duration of the call. The padding and radius of each key are applied at the output size, so
+// sources are never modified and only the ones that are actually used get rendered. Without cascading every key
+// is rendered straight from its source and all of the keys run in parallel, keys that downsample the same source
+// are resized together with resize_image_multi so the source is only read once. With cascading the keys that share a
+// source are produced from largest to smallest, each one downsampled from the previous unmodified output to form a
+// pyramid, and the chains for different sources run in parallel. In linear mode every source that has to be
+// resized is converted to a linear image once up front and all of the resizing happens on linear images. With
+// `standalone` set even a lone downsampled key goes through resize_image_multi, which makes every key come out the
+// same no matter which other keys it is rendered with (this is not possible when cascading). Streamed sources are
+// always resized that way as it is the only path that can decode them as it goes.
+static void render_keys(const std::vector<Image>& input_images, const std::vector<std::string>& image_paths, const std::vector<RenderKey>& keys, bool cascade, bool linear,
+                        bool standalone, ThreadPool& pool, const std::function<void(size_t, const Image&)>& emit)
+{
+    std::vector<LinearImage> linear_images(input_images.size());
+    if(linear)
+    {
+        std::vector<bool> needed(input_images.size(), false);
+        for(auto& key: keys)
+        {
+            s32 offset = 0, size = 0;
+            get_padded_rect(key.size, key.padding, offset, size);
+            const Image& source = input_images[key.source];
+            if(size > 0 && (source.width != size || source.height != size))
+            {
+                needed[key.source] = true;
+            }
+        }
+        parallel_for(pool, input_images.size(), [&](size_t i)
+        {
+            if(needed[i] && !linearize_image(input_images[i], linear_images[i]))
+            {
+                FAIL(MakeIconError_OutOfMemory, "Failed to allocate memory for %dx%d image!", input_images[i].width, input_images[i].height);
+            }
+        });
+    }
+
+    auto render = [&](size_t k, const Image& from, const LinearImage* linear_from)
+    {
+        const RenderKey& key = keys[k];
+        TraceScope scope("job");
+        scope.event.size = key.size;
+        bool modified = (key.padding > 0.0f || key.radius > 0.0f);
+        if(!modified && from.width == key.size && from.height == key.size)
+        {
+            emit(k, from);
+            return;
+        }
+        Image output;
+        if(!render_image(from, linear_from, key.size, key.padding, key.radius, output))
+        {
+            FAIL(MakeIconError_OutOfMemory, "Failed to allocate memory for %dx%d image!", key.size, key.size);
+        }
+        emit(k, output);
+        free_image(output);
+    };
+
+    if(!cascade)
+    {
+        // When two or more keys downsample the same source they are all resized together in a single pass over it.
+        std::vector<Image> resized_images;
+        std::vector<s32> resized_index(keys.size(), -1);
+        if(!linear)
+        {
+            for(size_t source=0; source<input_images.size(); ++source)
+            {
+                const Image& image = input_images[source];
+                std::vector<s32> sizes;
+                std::vector<size_t> users;
+                for(size_t k=0; k<keys.size(); ++k)
+                {
+                    s32 offset = 0, size = 0;
+                    get_padded_rect(keys[k].size, keys[k].padding, offset, size);
+                    if(keys[k].source == CAST(s32, source) && size > 0 && size < image.width && size < image.height)
+                    {
+                        sizes.push_back(size);
+                        users.push_back(k);
+                    }
+                }
+                // A streamed source has no pixels to resize from any other way.
+                if(sizes.empty() || (sizes.size() < 2 && !standalone && image.data))
+                {
+                    continue;
+                }
+                std::vector<Image> outputs;
+                if(!resize_image_multi(image, sizes, image_paths[source], pool, outputs))
+                {
+                    FAIL(MakeIconError_OutOfMemory, "Failed to allocate memory for %dx%d image!", sizes[0], sizes[0]);
+                }
+                for(size_t i=0; i<users.size(); ++i)
+                {
+                    resized_index[users[i]] = CAST(s32, resized_images.size());
+                    resized_images.push_back(outputs[i]);
+                }
+            }
+        }
+
+        parallel_for(pool, keys.size(), [&](size_t k)
+        {
+            if(resized_index[k] >= 0)
+            {
+                render(k, resized_images[resized_index[k]], NULL);
+                return;
+            }
+            const LinearImage& linear_source = linear_images[keys[k].source];
+            render(k, input_images[keys[k].source], (linear_source.data) ? &linear_source : NULL);
+        });
+
+        for(auto& image: resized_images)
+        {
+            free_image(image);
+        }
+    }
+    else
+    {
+        std::vector<std::vector<size_t>> chains;
+        for(size_t source=0; source<input_images.size(); ++source)
+        {
+            std::vector<size_t> chain;
+            for(size_t k=0; k<keys.size(); ++k)
+            {
+                if(keys[k].source == CAST(s32, source)) chain.push_back(k);
+            }
+            if(!chain.empty())
+            {
+                std::stable_sort(chain.begin(), chain.end(), [&](size_t a, size_t b) { return keys[a].size > keys[b].size; });
+                chains.push_back(chain);
+            }
+        }
+
+        parallel_for(pool, chains.size(), [&](size_t c)
+        {
+            const Image& source = input_images[keys[chains[c][0]].source];
+            const LinearImage& linear_source = linear_images[keys[chains[c][0]].source];
+            Image previous; // The last downsampled icon before modifiers, owned by this chain.
+            LinearImage linear_previous;
+            for(auto k: chains[c])
+            {
+                // The pyramid is built at the size of the padded inner square, which is what each output resizes to.
+                s32 offset = 0, size = 0;
+                get_padded_rect(keys[k].size, keys[k].padding, offset, size);
+                if(size <= 0 || (source.width == size && source.height == size))
+                {
+                    render(k, source, NULL);
+                    continue;
+                }
+                // Never cascade from an upsampled icon, those are always produced straight from the source.
+                bool downsampled = (size <= source.width && size <= source.height);
+                if(linear)
+                {
+                    const LinearImage& from = (linear_previous.data) ? linear_previous : linear_source;
+                    LinearImage resized;
+                    if(!resize_linear_image(from, size, size, resized))
+                    {
+                        FAIL(MakeIconError_OutOfMemory, "Failed to allocate memory for %dx%d image!", size, size);
+                    }
+                    render(k, source, &resized);
+                    if(downsampled)
+                    {
+                        free_linear_image(linear_previous);
+                        linear_previous = resized;
+                    }
+                    else
+                    {
+                        free_linear_image(resized);
+                    }
+                }
+                else
+                {
+                    const Image& from = (previous.data) ? previous : source;
+                    Image resized;
+                    if(!resize_image(from, size, size, resized))
+                    {
+                        FAIL(MakeIconError_OutOfMemory, "Failed to allocate memory for %dx%d image!", size, size);
+                    }
+                    render(k, resized, NULL);
+                    if(downsampled)
+                    {
+                        free_image(previous);
+                        previous = resized;
+                    }
+                    else
+                    {
+                        free_image(resized);
+                    }
+                }
+            }
+            free_image(previous);
+            free_linear_image(linear_previous);
+        });
+    }
+
+    for(auto& image: linear_images)
+    {
+        free_linear_image(image);
+    }
+}
+
+static RenderSettings get_render_settings(const Options& options, const RenderKey& key)
+{
+    RenderSettings settings;
+    settings.size = key.size;
+    settings.padding = key.padding;
+    settings.radius = key.radius;
+    settings.linear = options.linear;
+    return settings;
+}
+
+// Same as render_keys with the settings from the options, but in batch mode icons that any job has already
+// rendered are taken from the image cache and the ones rendered here are added to it.
+static void render_shared_keys(const Options& options, const std::vector<Image>& input_images, const std::vector<RenderKey>& keys,
+                               Context& context, const std::function<void(size_t, const Image&)>& emit)
+{
+    // A cascaded key depends on the other sizes of its chain, so those are never shared. An update renders some
+    // entries now and reuses others from earlier runs, so every key has to come out the same on its own.
+    if(!context.cache || options.cascade)
+    {
+        render_keys(input_images, context.image_paths, keys, options.cascade, options.linear, options.update, context.pool, emit);
+        return;
+    }
+
+    auto get_settings = [&](const RenderKey& key) { return get_render_settings(options, key); };
+
+    // Renders are never removed while a job that uses their source is running, so the pointers stay valid.
+    std::vector<const Image*> cached(keys.size(), NULL);
+    std::vector<RenderKey> missing;
+    std::vector<size_t> missing_keys;
+    {
+        std::lock_guard<std::mutex> lock(context.cache->mutex);
+        for(size_t k=0; k<keys.size(); ++k)
+        {
+            SharedSource& source = context.cache->sources[get_shared_source_name(context.image_paths[keys[k].source])];
+            auto it = source.renders.find(get_settings(keys[k]));
+            if(it != source.renders.end())
+            {
+                cached[k] = &it->second;
+            }
+            else
+            {
+                missing.push_back(keys[k]);
+                missing_keys.push_back(k);
+            }
+        }
+    }
+
+    parallel_for(context.pool, keys.size(), [&](size_t k)
+    {
+        if(cached[k]) emit(k, *cached[k]);
+    });
+
+    render_keys(input_images, context.image_paths, missing, false, options.linear, true, context.pool, [&](size_t m, const Image& image)
+    {
+        size_t k = missing_keys[m];
+        const Image& source_image = input_images[keys[k].source];
+        if(image.data != source_image.data) // Unmodified sources are emitted as they are, they are already shared.
+        {
+            Image copy = image;
+            size_t size = CAST(size_t, image.width) * image.height * image.bpp;
+            copy.data = CAST(u8*, malloc(size));
+            if(copy.data)
+            {
+                memcpy(copy.data, image.data, size);
+                std::lock_guard<std::mutex> lock(context.cache->mutex);
+                SharedSource& source = context.cache->sources[get_shared_source_name(context.image_paths[keys[k].source])];
+                if(!source.renders.emplace(get_settings(keys[k]), copy).second)
+                {
+                    free_image(copy); // Another job rendered it at the same time.
+                }
+            }
+        }
+        emit(k, image);
+    });
+}
+
+// Renders the keys and encodes them with encode, emit is handed each encoded icon and takes ownership of it. In batch
+// mode the encoded bytes are kept in the image cache along with the render, so icons that any job has already
+// encoded the same way are copied out of the cache without being rendered or encoded again. The format is the .ico
+// format the encoder follows, for everything else it is IcoFormat_Png.
+static void encode_shared_keys(const Options& options, const std::vector<Image>& input_images, const std::vector<RenderKey>& keys, IcoFormat format, Context& context,
+                               const std::function<PngImage(const Image&)>& encode, const std::function<void(size_t, PngImage&)>& emit)
+{
+    auto encode_key = [&](const Image& image)
+    {
+        PngImage png = encode(image);
+        if(!png.data)
+        {
+            FAIL(MakeIconError_EncodeFailed, "Failed to encode %dx%d image!", image.width, image.height);
+        }
+        return png;
+    };
+
+    if(!context.cache || options.cascade)
+    {
+        render_shared_keys(options, input_images, keys, context, [&](size_t k, const Image& image)
+        {
+            PngImage png = encode_key(image);
+            emit(k, png);
+        });
+        return;
+    }
+
+    auto get_settings = [&](const RenderKey& key)
+    {
+        EncodeSettings settings;
+        settings.render = get_render_settings(options, key);
+        settings.compression = options.compression;
+        settings.format = format;
+        return settings;
+    };
+
+    std::vector<const std::vector<u8>*> cached(keys.size(), NULL);
+    std::vector<RenderKey> missing;
+    std::vector<size_t> missing_keys;
+    {
+        std::lock_guard<std::mutex> lock(context.cache->mutex);
+        for(size_t k=0; k<keys.size(); ++k)
+        {
+            SharedSource& source = context.cache->sources[get_shared_source_name(context.image_paths[keys[k].source])];
+            auto it = source.encodings.find(get_settings(keys[k]));
+            if(it != source.encodings.end())
+            {
+                cached[k] = &it->second;
+            }
+            else
+            {
+                missing.push_back(keys[k]);
+                missing_keys.push_back(k);
+            }
+        }
+    }
+
+    parallel_for(context.pool, keys.size(), [&](size_t k)
+    {
+        if(!cached[k]) return;
+        PngImage png;
+        png.width = keys[k].size;
+        png.height = keys[k].size;
+        png.data_size = cached[k]->size();
+        png.data = CAST(u8*, malloc(png.data_size));
+        if(!png.data)
+        {
+            FAIL(MakeIconError_OutOfMemory, "Failed to allocate memory for %dx%d image!", png.width, png.height);
+        }
+        memcpy(png.data, cached[k]->data(), png.data_size);
+        emit(k, png);
+    });
+
+    render_shared_keys(options, input_images, missing, context, [&](size_t m, const Image& image)
+    {
+        size_t k = missing_keys[m];
+        PngImage png = encode_key(image);
+        {
+            std::lock_guard<std::mutex> lock(context.cache->mutex);
+            SharedSource& source = context.cache->sources[get_shared_source_name(context.image_paths[keys[k].source])];
+            source.encodings.emplace(get_settings(keys[k]), std::vector<u8>(png.data, png.data + png.data_size));
+        }
+        emit(k, png);
+    });
+}
+
+// Renders and encodes every unique key of the plan once, the results are indexed the same as plan.keys.
+static void encode_render_plan(const Options& options, const std::vector<Image>& input_images, const RenderPlan& plan, Context& context, std::vector<PngImage>& encoded)
+{
+    encoded.resize(plan.keys.size());
+    encode_shared_keys(options, input_images, plan.keys, IcoFormat_Png, context,
+                       [&](const Image& image) { return PngImage(image, options.compression); },
+                       [&](size_t k, PngImage& png) { encoded[k] = png; });
+}
+
+static void run_render_jobs(const Options& options, const std::vector<RenderJob>& jobs, const std::vector<Image>& input_images, Context& context)
+{
+    std::vector<s32> sizes;
+    for(auto& job: jobs)
+    {
+        sizes.push_back(job.size);
+    }
+
+    RenderPlan plan;
+    plan_renders(options, input_images, sizes, options.resize, plan);
+
+    std::vector<PngImage> encoded;
+    encode_render_plan(options, input_images, plan, context, encoded);
+
+    // Write the encoded bytes out to every file that needs them.
+    parallel_for(context.pool, jobs.size(), [&](size_t i)
+    {
+        const PngImage& png = encoded[plan.outputs[i]];
+        if(!write_output_file(context.writer, jobs[i].filename, png.data, png.data_size))
+        {
+            FAIL(MakeIconError_WriteFailed, "Failed to save output file: %s", jobs[i].filename.c_str());
+        }
+    });
+
+    for(auto& png: encoded)
+    {
+        free_png_image(png);
+    }
+}
+
+//
+// Cache
+//
+
+// The cache stores every file written by a run in a single entry file named after a hash of everything that can
+// affect the output: the makeicon version, the options, the contents json, and the bytes of every input image.
+
+static constexpr u32 CACHE_MAGIC   = 0x43494B4D; // "MKIC"
+static constexpr u32 CACHE_VERSION = 2; // Bumped whenever the bytes written for the same options change.
+
+// xxHash64 (https://github.com/Cyan4973/xxHash), fast enough that hashing the inputs costs far less than decoding them.
+static constexpr u64 HASH_PRIME_1 = 0x9E3779B185EBCA87ULL;
+static constexpr u64 HASH_PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+static constexpr u64 HASH_PRIME_3 = 0x165667B19E3779F9ULL;
+static constexpr u64 HASH_PRIME_4 = 0x85EBCA77C2B2AE63ULL;
+static constexpr u64 HASH_PRIME_5 = 0x27D4EB2F165667C5ULL;
+
+static inline u64 hash_rotl(u64 x, s32 r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline u64 hash_read64(const u8* p)
+{
+    u64 v; memcpy(&v, p, sizeof(v)); return v;
+}
+
+static inline u32 hash_read32(const u8* p)
+{
+    u32 v; memcpy(&v, p, sizeof(v)); return v;
+}
+
+static inline u64 hash_round(u64 acc, u64 input)
+{
+    acc += input * HASH_PRIME_2;
+    acc = hash_rotl(acc, 31);
+    return acc * HASH_PRIME_1;
+}
+
+static inline u64 hash_merge_round(u64 acc, u64 val)
+{
+    acc ^= hash_round(0, val);
+    return acc * HASH_PRIME_1 + HASH_PRIME_4;
+}
+
+static u64 hash_bytes(const void* data, size_t size, u64 seed = 0)
+{
+    const u8* p = CAST(const u8*, data);
+    const u8* end = p + size;
+    u64 h;
+
+    if(size >= 32)
+    {
+        u64 v1 = seed + HASH_PRIME_1 + HASH_PRIME_2;
+        u64 v2 = seed + HASH_PRIME_2;
+        u64 v3 = seed;
+        u64 v4 = seed - HASH_PRIME_1;
+        const u8* limit = end - 32;
+        do
+        {
+            v1 = hash_round(v1, hash_read64(p)); p += 8;
+            v2 = hash_round(v2, hash_read64(p)); p += 8;
+            v3 = hash_round(v3, hash_read64(p)); p += 8;
+            v4 = hash_round(v4, hash_read64(p)); p += 8;
+        }
+        while(p <= limit);
+        h = hash_rotl(v1, 1) + hash_rotl(v2, 7) + hash_rotl(v3, 12) + hash_rotl(v4, 18);
+        h = hash_merge_round(h, v1);
+        h = hash_merge_round(h, v2);
+        h = hash_merge_round(h, v3);
+        h = hash_merge_round(h, v4);
+    }
+    else
+    {
+        h = seed + HASH_PRIME_5;
+    }
+
+    h += CAST(u64, size);
+    for(; p + 8 <= end; p += 8)
+    {
+        h ^= hash_round(0, hash_read64(p));
+        h = hash_rotl(h, 27) * HASH_PRIME_1 + HASH_PRIME_4;
+    }
+    if(p + 4 <= end)
+    {
+        h ^= CAST(u64, hash_read32(p)) * HASH_PRIME_1;
+        h = hash_rotl(h, 23) * HASH_PRIME_2 + HASH_PRIME_3;
+        p += 4;
+    }
+    for(; p < end; ++p)
+    {
+        h ^= (*p) * HASH_PRIME_5;
+        h = hash_rotl(h, 11) * HASH_PRIME_1;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_PRIME_2;
+    h ^= h >> 29;
+    h *= HASH_PRIME_3;
+    h ^= h >> 32;
+    return h;
+}
+
+template<typename T>
+static inline u64 hash_value(u64 hash, const T& value)
+{
+    return hash_bytes(&value, sizeof(value), hash);
+}
+
+static inline u64 hash_string(u64 hash, const std::string& str)
+{
+    hash = hash_value(hash, CAST(u64, str.size()));
+    return hash_bytes(str.data(), str.size(), hash);
+}
+
+static u64 hash_cache_key(const Options& options, const std::vector<MappedFile>& input_files, ThreadPool& pool)
+{
+    // The inputs are by far the largest part of the key so they get hashed in parallel.
+    std::vector<u64> input_hashes(input_files.size());
+    parallel_for(pool, input_files.size(), [&](size_t i)
+    {
+        input_hashes[i] = hash_bytes(input_files[i].data, input_files[i].size);
+    });
+
+    u64 hash = hash_value(0, CACHE_VERSION);
+    hash = hash_value(hash, CAST(s32, MAKEICON_VERSION_MAJOR));
+    hash = hash_value(hash, CAST(s32, MAKEICON_VERSION_MINOR));
+    hash = hash_value(hash, options.platform);
+    hash = hash_value(hash, options.resize);
+    hash = hash_value(hash, options.cascade);
+    hash = hash_value(hash, options.linear);
+    hash = hash_value(hash, options.padding);
+    hash = hash_value(hash, options.radius);
+    hash = hash_value(hash, options.compression);
+    hash = hash_value(hash, options.ico_format);
+    hash = hash_value(hash, CAST(u64, options.sizes.size()));
+    for(auto size: options.sizes)
+    {
+        hash = hash_value(hash, size);
+    }
+    hash = hash_string(hash, options.output);
+    if(!options.contents.empty())
+    {
+        std::vector<u8> contents = read_entire_binary_file(options.contents);
+        hash = hash_value(hash, hash_bytes(contents.data(), contents.size()));
+    }
+    hash = hash_value(hash, CAST(u64, input_hashes.size()));
+    for(auto input_hash: input_hashes)
+    {
+        hash = hash_value(hash, input_hash);
+    }
+    return hash;
+}
+
+static std::string get_cache_file_name(const Options& options, u64 key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.mkc", CAST(unsigned long long, key));
+    return (std::filesystem::path(options.cache) / name).string();
+}
+
+// Returns true if a cache entry existed for the key and all of its files were written out.
+static bool load_cached_output(const Options& options, u64 key, OutputWriter& writer)
+{
+    std::string file_name = get_cache_file_name(options, key);
+    std::error_code error;
+    if(!std::filesystem::is_regular_file(file_name, error))
+    {
+        return false;
+    }
+
+    std::vector<u8> entry = read_entire_binary_file(file_name);
+    size_t pos = 0;
+    auto read = [&](void* dst, size_t size)
+    {
+        if(pos + size > entry.size()) return false;
+        memcpy(dst, entry.data() + pos, size);
+        pos += size;
+        return true;
+    };
+
+    // Validate the whole entry before writing anything, a damaged entry is treated as a miss.
+    u32 magic = 0, version = 0, count = 0;
+    if(!read(&magic, sizeof(magic)) || !read(&version, sizeof(version)) || !read(&count, sizeof(count)))
+    {
+        return false;
+    }
+    if(magic != CACHE_MAGIC || version != CACHE_VERSION)
+    {
+        return false;
+    }
+
+    struct CachedFile { std::string file_name; size_t offset; u64 size; };
+    std::vector<CachedFile> files;
+    for(u32 i=0; i<count; ++i)
+    {
+        u32 name_size = 0;
+        CachedFile file;
+        if(!read(&name_size, sizeof(name_size)) || pos + name_size > entry.size())
+        {
+            return false;
+        }
+        file.file_name.assign(CAST(const char*, entry.data() + pos), name_size);
+        pos += name_size;
+        if(!read(&file.size, sizeof(file.size)) || pos + file.size > entry.size())
+        {
+            return false;
+        }
+        file.offset = pos;
+        pos += file.size;
+        files.push_back(file);
+    }
+
+    for(auto& file: files)
+    {
+        std::filesystem::path parent = std::filesystem::path(file.file_name).parent_path();
+        if(!parent.empty() && !std::filesystem::exists(parent))
+        {
+            std::filesystem::create_directories(parent);
+        }
+        if(!write_output_file(writer, file.file_name, entry.data() + file.offset, file.size))
+        {
+            FAIL(MakeIconError_WriteFailed, "Failed to save output file: %s", file.file_name.c_str());
+        }
+    }
+    return true;
+}
+
+static void save_cached_output(const Options& options, u64 key, OutputWriter& writer)
+{
+    std::vector<u8> entry;
+    auto write = [&](const void* src, size_t size)
+    {
+        entry.insert(entry.end(), CAST(const u8*, src), CAST(const u8*, src) + size);
+    };
+
+    // Files are sorted by name so the entry doesn't depend on the order the jobs happened to finish in.
+    std::sort(writer.files.begin(), writer.files.end(), [](const OutputFile& a, const OutputFile& b) { return a.file_name < b.file_name; });
+
+    u32 count = CAST(u32, writer.files.size());
+    write(&CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    write(&CACHE_VERSION, sizeof(CACHE_VERSION));
+    write(&count, sizeof(count));
+    for(auto& file: writer.files)
+    {
+        u32 name_size = CAST(u32, file.file_name.size());
+        u64 size = CAST(u64, file.data.size());
+        write(&name_size, sizeof(name_size));
+        write(file.file_name.data(), name_size);
+        write(&size, sizeof(size));
+        write(file.data.data(), file.data.size());
+    }
+
+    // Write to a temporary file first so that a concurrent run never sees a partially written entry.
+    std::error_code error;
+    std::filesystem::create_directories(options.cache, error);
+    std::string file_name = get_cache_file_name(options, key);
+    std::string temp_name = file_name + ".tmp" + std::to_string(std::random_device()());
+    if(!write_entire_binary_file(temp_name, entry.data(), entry.size()))
+    {
+        WARNING("Failed to write cache entry: %s", file_name.c_str());
+        std::filesystem::remove(temp_name, error);
+        return;
+    }
+    std::filesystem::rename(temp_name, file_name, error);
+    if(error)
+    {
+        WARNING("Failed to write cache entry: %s", file_name.c_str());
+        std::filesystem::remove(temp_name, error);
+    }
+}
+
+// The state of an -update of an .ico file, see prepare_ico_update.
+struct IcoUpdate
+{
+    std::vector<u64>             fingerprints; // For each requested entry, a hash of everything its pixels depend on.
+    std::vector<std::vector<u8>> blobs;        // For each requested entry, the existing PNG or DIB, empty if it needs rendering.
+};
+
+static s32 make_icon_win32(const Options& options, const std::vector<Image>& input_images, const IcoUpdate* update, Context& context);
+static void prepare_ico_update(const Options& options, const std::vector<MappedFile>& input_files, Context& context, IcoUpdate& update);
+static s32 make_icon_android(const Options& options, const std::vector<RenderJob>& jobs, const std::vector<Image>& input_images, Context& context);
+static s32 make_icon_apple(const Options& options, const std::string& contents, const std::vector<RenderJob>& jobs, const std::vector<Image>& input_images, Context& context);
+
+static void get_android_render_jobs(const Options& options, std::vector<RenderJob>& jobs);
+#if !defined(MAKEICON_NO_MAIN) || defined(MAKEICON_BENCH)
+static void read_apple_contents(const Options& options, std::string& contents);
+#endif
+static void get_apple_render_jobs(const Options& options, const std::string& contents, std::vector<RenderJob>& jobs);
+static void get_icns_render_jobs(const Options& options, std::vector<RenderJob>& jobs);
+static bool is_icns_output(const Options& options);
+
+// Reads only the header of every input to get its dimensions and orders the inputs from smallest to largest, the
+// images are left without any pixel data. `files` is set to the input each image was read from.
+static void probe_input_images(const Options& options, const std::vector<MappedFile>& input_files, Context& context, std::vector<Image>& input_images, std::vector<size_t>& files)
+{
+    files.resize(input_files.size());
+    input_images.resize(input_files.size());
+
+    for(size_t i=0; i<files.size(); ++i)
+    {
+        files[i] = i;
+        const std::string& file_name = options.input[i];
+        const MappedFile& file = input_files[i];
+        Image& image = input_images[i];
+        s32 channels = 0;
+        if(file.width > 0)
+        {
+            image.width = file.width;
+            image.height = file.height;
+        }
+        else if(!stbi_info_from_memory(file.data, CAST(s32, file.size), &image.width,&image.height,&channels))
+        {
+            FAIL(MakeIconError_InvalidInput, "Failed to load input image: %s", file_name.c_str());
+        }
+        image.bpp = 4; // We force to 4-channel RGBA when decoding.
+
+        // We warn about non-square images as they will be stretched to a square aspect.
+        if(image.width != image.height)
+        {
+            WARNING("Image file '%s' is not square and will be stretched! Consider changing its size.", file_name.c_str());
+        }
+        // We warn if two images are passed in with the same size.
+        for(size_t j=0; j<i; ++j)
+        {
+            if((input_images[j].width == image.width) && (input_images[j].height == image.height))
+            {
+                WARNING("Two provided image files have the same siize of %dx%d! It is ambiguous which one will be used.", image.width,image.height);
+                break;
+            }
+        }
+    }
+
+    // Order the inputs from smallest to largest so source selection can pick the nearest larger image.
+    std::vector<size_t> order(input_images.size());
+    for(size_t i=0; i<order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return input_images[a] < input_images[b]; });
+    std::vector<Image> sorted_images;
+    std::vector<size_t> sorted_files;
+    for(auto i: order)
+    {
+        sorted_images.push_back(input_images[i]);
+        sorted_files.push_back(files[i]);
+    }
+    input_images.swap(sorted_images);
+    files.swap(sorted_files);
+    context.image_paths.clear();
+    for(auto file: files)
+    {
+        context.image_paths.push_back(options.input[file]);
+    }
+}
+
+// Probes the inputs, works out which of them are needed to produce the requested sizes, and then fully decodes
+// just those inputs in parallel. Inputs that are not needed stay in the list but are left without any pixel data.
+static void load_input_images(const Options& options, const std::vector<MappedFile>& input_files, const std::vector<s32>& sizes, bool resize, Context& context, std::vector<Image>& input_images)
+{
+    std::vector<size_t> files;
+    probe_input_images(options, input_files, context, input_images, files);
+
+    // Build the table of which inputs each requested size needs.
+    RenderPlan plan;
+    plan_renders(options, input_images, sizes, resize, plan);
+    std::vector<bool> needed(input_images.size(), false);
+    for(auto& key: plan.keys)
+    {
+        needed[key.source] = true;
+    }
+
+    // A huge PNG that every key downsamples is streamed while resizing instead of being decoded here, that is only
+    // possible for the straight multi-target resize so not when cascading or resizing in linear light.
+    std::vector<bool> streamed(input_images.size(), !options.cascade && !options.linear);
+    for(auto& key: plan.keys)
+    {
+        const Image& image = input_images[key.source];
+        s32 offset = 0, size = 0;
+        get_padded_rect(key.size, key.padding, offset, size);
+        if(size <= 0 || size >= image.width || size >= image.height) streamed[key.source] = false;
+    }
+    for(size_t i=0; i<needed.size(); ++i)
+    {
+        const MappedFile& file = input_files[files[i]];
+        Image& image = input_images[i];
+        PngStream stream;
+        streamed[i] = streamed[i] && needed[i] && file.width == 0 && CAST(s64, image.width) * image.height >= STREAM_SOURCE_PIXELS &&
+                      open_png_stream(file.data, file.size, options.input[files[i]], stream);
+        if(streamed[i])
+        {
+            image.encoded = file.data;
+            image.encoded_size = file.size;
+        }
+    }
+
+    std::vector<size_t> decode_list;
+    for(size_t i=0; i<needed.size(); ++i)
+    {
+        if(needed[i] && !streamed[i]) decode_list.push_back(i);
+    }
+
+    parallel_for(context.pool, decode_list.size(), [&](size_t i)
+    {
+        const MappedFile& file = input_files[files[decode_list[i]]];
+        const std::string& file_name = options.input[files[decode_list[i]]];
+        auto decode = [&]()
+        {
+            Image image = input_images[decode_list[i]];
+            TraceScope scope("decode");
+            if(scope.trace) scope.event.detail = file_name;
+            s32 channels = 0;
+            if(file.width > 0)
+            {
+                // Raw pixels are copied so that every image owns its data, the same as a decoded one.
+                image.data = CAST(u8*, malloc(file.size));
+                if(!image.data)
+                {
+                    FAIL(MakeIconError_OutOfMemory, "Failed to allocate memory for %dx%d image!", image.width, image.height);
+                }
+                memcpy(image.data, file.data, file.size);
+            }
+            else
+            {
+                image.data = stbi_load_from_memory(file.data, CAST(s32, file.size), &image.width,&image.height,&channels,4); // We force to 4-channel RGBA.
+            }
+            if(!image.data)
+            {
+                FAIL(MakeIconError_InvalidInput, "Failed to load input image: %s", file_name.c_str());
+            }
+            scope.event.size = image.width;
+            scope.event.pixels = CAST(u64, image.width) * image.height;
+            scope.event.bytes_in = file.size;
+            scope.event.bytes_out = scope.event.pixels * 4;
+            return image;
+        };
+        // In batch mode the image is owned by the cache and shared with every other job that uses the same file.
+        input_images[decode_list[i]] = (context.cache) ? acquire_shared_source(*context.cache, file_name, decode) : decode();
+    });
+}
+
+// Prints every output of the run along with its size and the input it will be rendered from. The text is built up
+// and printed in one go so the plans of concurrent manifest jobs don't interleave.
+static void print_render_plan(const Options& options, const std::vector<RenderJob>& jobs, const std::vector<Image>& input_images, const Context& context, const RenderPlan& plan)
+{
+    std::vector<bool> used(input_images.size(), false);
+    for(auto& key: plan.keys)
+    {
+        used[key.source] = true;
+    }
+    size_t decoded = std::count(used.begin(), used.end(), true);
+
+    std::string text;
+    char line[1024];
+    snprintf(line, sizeof(line), "[makeicon] plan for %s (%s): %zu outputs, %zu renders, %zu of %zu inputs decoded\n",
+        options.output.c_str(), PLATFORM_NAMES[options.platform], plan.outputs.size(), plan.keys.size(), decoded, input_images.size());
+    text += line;
+
+    std::vector<bool> rendered(plan.keys.size(), false);
+    for(size_t i=0; i<plan.outputs.size(); ++i)
+    {
+        const RenderKey& key = plan.keys[plan.outputs[i]];
+        const Image& source = input_images[key.source];
+        const char* action = "copy";
+        if(source.width > key.size || source.height > key.size) action = "downsample";
+        else if(source.width < key.size || source.height < key.size) action = "upsample";
+
+        // On win32 every size is an entry of the one .ico file.
+        std::string output = (i < jobs.size()) ? jobs[i].filename : options.output;
+        std::string idiom;
+        if(i < jobs.size() && jobs[i].element) idiom = std::string(" [") + jobs[i].element + "]";
+        else if(i < jobs.size() && !jobs[i].idiom.empty()) idiom = " [" + jobs[i].idiom + "]";
+        snprintf(line, sizeof(line), "    %-48s %4dx%-4d%s <- %s (%dx%d, %s%s)\n", output.c_str(), key.size, key.size, idiom.c_str(),
+            context.image_paths[key.source].c_str(), source.width, source.height, action, (rendered[plan.outputs[i]]) ? ", reused" : "");
+        text += line;
+        rendered[plan.outputs[i]] = true;
+    }
+    fputs(text.c_str(), stdout);
+}
+
+#if !defined(MAKEICON_NO_MAIN) || defined(MAKEICON_BENCH)
+// Stops recording to the trace and reports it as requested by the options.
+static void finish_trace(const Options& options, std::unique_ptr<Trace>& trace)
+{
+    if(!trace)
+    {
+        return;
+    }
+    current_trace = NULL;
+    if(options.stats)
+    {
+        print_trace_stats(*trace);
+    }
+    if(!options.trace.empty() && !save_trace(*trace, options.trace))
+    {
+        WARNING("Failed to save trace file: %s", options.trace.c_str());
+    }
+    trace.reset();
+}
+#endif
+
+static s32 get_max_icon_size(const Options& options)
+{
+    if(is_icns_output(options)) return 1024;
+    if(options.platform == Platform_Win32) return 256;
+    return MAX_ICON_SIZE;
+}
+
+// Checks that there is enough to run with, for the apple platforms the sizes can come from the contents json instead
+// and an .icns file gets every size it can hold if none are given.
+static void validate_options(const Options& options, bool has_contents)
+{
+    if(options.sizes.empty() && !has_contents && !is_icns_output(options))
+        FAIL(MakeIconError_InvalidArgument, "No icon sizes provided! Specify sizes using: -sizes:x,y,z,w...");
+    if(options.input.empty())
+        FAIL(MakeIconError_InvalidArgument, "No input images provided! Specify input using: -input:x,y,z,w...");
+    if(options.output.empty())
+        FAIL(MakeIconError_InvalidArgument, "No output name provded! Specify output name like so: makeicon ... outputname.ico");
+
+    // The maximum size allowed in an ICO file is 256x256 and 1024x1024 in an ICNS file, the other platforms write
+    // plain PNGs so they are only held to a sanity limit. We also check for 0 or less as that would not be valid either...
+    s32 max_size = get_max_icon_size(options);
+    for(auto& size: options.sizes)
+    {
+        if(size > max_size)
+            FAIL(MakeIconError_InvalidArgument, "Invalid icon size '%d'! Maximum value allowed is %d pixels.", size, max_size);
+        if(size <= 0)
+            FAIL(MakeIconError_InvalidArgument, "Invalid icon size '%d'! Minimum value allowed is 1 pixel.", size);
+    }
+}
+
+// Generates the icon from inputs that have already been mapped (or handed in by the library), writing every file
+// through the context's writer. The inputs are released as soon as they have been decoded. Failures are thrown as
+// a RunFailure, anything the run allocated is freed before it propagates.
+static s32 generate_icon(const Options& options, const std::string& contents, std::vector<MappedFile>& input_files, Context& context)
+{
+    // Work out every output size the platform needs up front, so that we know which inputs to load.
+    std::vector<RenderJob> jobs;
+    std::vector<s32> sizes;
+    bool resize = options.resize;
+    switch(options.platform)
+    {
+        case Platform_Win32:
+        {
+            sizes = options.sizes;
+            resize = true; // The win32 path has always resized the largest input to fill in missing sizes.
+        } break;
+        case Platform_OSX:
+        case Platform_iOS:
+        {
+            if(is_icns_output(options) && contents.empty()) get_icns_render_jobs(options, jobs);
+            else get_apple_render_jobs(options, contents, jobs);
+        } break;
+        case Platform_Android:
+        {
+            get_android_render_jobs(options, jobs);
+        } break;
+    }
+    for(auto& job: jobs)
+    {
+        sizes.push_back(job.size);
+    }
+
+    // The whole plan is known at this point, so a dry run only needs the image headers to report it.
+    if(options.dry_run)
+    {
+        std::vector<Image> input_images;
+        std::vector<size_t> files;
+        probe_input_images(options, input_files, context, input_images, files);
+        RenderPlan plan;
+        plan_renders(options, input_images, sizes, resize, plan);
+        print_render_plan(options, jobs, input_images, context, plan);
+        return EXIT_SUCCESS;
+    }
+
+    // If this exact run has been done before then the cached output can be written out without loading anything.
+    u64 cache_key = 0;
+    if(!options.cache.empty())
+    {
+        bool cached = false;
+        {
+            TraceScope scope("cache");
+            cache_key = hash_cache_key(options, input_files, context.pool);
+            cached = load_cached_output(options, cache_key, context.writer);
+        }
+        if(cached)
+        {
+            return EXIT_SUCCESS;
+        }
+        context.writer.record = true;
+    }
+
+    // An update copies the .ico entries that are still up to date, so only the others have to be loaded and rendered.
+    IcoUpdate update;
+    if(options.update && options.platform == Platform_Win32)
+    {
+        TraceScope scope("update");
+        prepare_ico_update(options, input_files, context, update);
+        sizes.clear();
+        for(size_t i=0; i<options.sizes.size(); ++i)
+        {
+            if(update.blobs[i].empty()) sizes.push_back(options.sizes[i]);
+        }
+    }
+
+    s32 result = EXIT_FAILURE;
+
+    std::vector<Image> input_images;
+    try
+    {
+        load_input_images(options, input_files, sizes, resize, context, input_images);
+
+        // The decoded images are all we need from here on, apart from the files of streamed sources.
+        for(auto& file: input_files)
+        {
+            bool streamed = false;
+            for(auto& image: input_images)
+            {
+                streamed = streamed || (image.encoded && image.encoded == file.data);
+            }
+            if(!streamed) unmap_file(file);
+        }
+
+        // Run the icon generation code for the desired platform.
+        switch(options.platform)
+        {
+            case Platform_Win32:
+            {
+                result = make_icon_win32(options, input_images, (options.update) ? &update : NULL, context);
+            } break;
+            case Platform_OSX:
+            case Platform_iOS:
+            {
+                result = make_icon_apple(options, contents, jobs, input_images, context);
+            } break;
+            case Platform_Android:
+            {
+                result = make_icon_android(options, jobs, input_images, context);
+            } break;
+            default:
+            {
+                WARNING("Unknown platform ID used for making icon: %d", options.platform);
+            } break;
+        }
+
+        if(!options.cache.empty() && result == EXIT_SUCCESS)
+        {
+            TraceScope scope("cache");
+            save_cached_output(options, cache_key, context.writer);
+        }
+    }
+    catch(...)
+    {
+        for(auto& image: input_images)
+        {
+            if(!context.cache) free_image(image);
+        }
+        throw;
+    }
+
+    // Free all of the loaded to avoid memory leaking, in batch mode they belong to the image cache.
+    for(auto& image: input_images)
+    {
+        if(!context.cache) free_image(image);
+    }
+
+    return result;
+}
+
+#if !defined(MAKEICON_NO_MAIN) || defined(MAKEICON_BENCH)
+// Generates the icon from the input files named in the options.
+static s32 generate_icon_files(const Options& options, Context& context)
+{
+    validate_options(options, !options.contents.empty());
+
+    // An .icns file can be made from the sizes alone so the contents json is optional for it.
+    std::string contents;
+    if((options.platform == Platform_OSX || options.platform == Platform_iOS) && !(is_icns_output(options) && options.contents.empty()))
+    {
+        read_apple_contents(options, contents);
+    }
+
+    s32 result = EXIT_FAILURE;
+    std::vector<MappedFile> input_files(options.input.size());
+    try
+    {
+        // Every input is mapped once and the same mapping is used for hashing, probing and decoding.
+        {
+            TraceScope scope("map");
+            for(size_t i=0; i<input_files.size(); ++i)
+            {
+                if(!map_file(options.input[i], input_files[i]))
+                {
+                    FAIL(MakeIconError_InvalidInput, "Failed to load input image: %s", options.input[i].c_str());
+                }
+                scope.event.bytes_in += input_files[i].size;
+            }
+        }
+        result = generate_icon(options, contents, input_files, context);
+    }
+    catch(...)
+    {
+        for(auto& file: input_files)
+        {
+            unmap_file(file);
+        }
+        throw;
+    }
+
+    for(auto& file: input_files)
+    {
+        unmap_file(file);
+    }
+    return result;
+}
+#endif
+
+//
+// Library
+//
+
+MakeIconError makeicon_generate(const MakeIconRequest& request, std::vector<MakeIconFile>& files, std::string* message)
+{
+    Options options;
+    options.platform = Platform_COUNT;
+    for(Platform i=0; i<Platform_COUNT; ++i)
+    {
+        if(request.platform == PLATFORM_NAMES[i]) options.platform = i;
+    }
+    options.compression = Compression_COUNT;
+    for(Compression i=0; i<Compression_COUNT; ++i)
+    {
+        if(request.compression == COMPRESSION_NAMES[i]) options.compression = i;
+    }
+    options.ico_format = IcoFormat_COUNT;
+    for(IcoFormat i=0; i<IcoFormat_COUNT; ++i)
+    {
+        if(request.ico_format == ICO_FORMAT_NAMES[i]) options.ico_format = i;
+    }
+    options.resize = request.resize;
+    options.cascade = request.cascade;
+    options.linear = request.linear;
+    options.sizes.assign(request.sizes.begin(), request.sizes.end());
+    options.output = request.output;
+    options.padding = request.padding;
+    options.radius = request.radius;
+    options.jobs = request.jobs;
+
+    // The inputs are used in place, raw pixels skip decoding.
+    std::vector<MappedFile> input_files(request.inputs.size());
+    for(size_t i=0; i<request.inputs.size(); ++i)
+    {
+        const MakeIconInput& input = request.inputs[i];
+        options.input.push_back((input.name.empty()) ? "input " + std::to_string(i) : input.name);
+        input_files[i].data = input.data;
+        input_files[i].size = input.size;
+        input_files[i].width = input.width;
+        input_files[i].height = input.height;
+    }
+
+    ThreadPool pool;
+    Context context { pool };
+    context.writer.memory = true;
+
+    MakeIconError error = MakeIconError_None;
+    std::string error_message;
+    try
+    {
+        if(options.platform == Platform_COUNT)
+            FAIL(MakeIconError_InvalidArgument, "Unknown platform: %s", request.platform.c_str());
+        if(options.compression == Compression_COUNT)
+            FAIL(MakeIconError_InvalidArgument, "Unknown compression level: %s", request.compression.c_str());
+        if(options.ico_format == IcoFormat_COUNT)
+            FAIL(MakeIconError_InvalidArgument, "Unknown ico format: %s", request.ico_format.c_str());
+        if(options.jobs < 0)
+            FAIL(MakeIconError_InvalidArgument, "Invalid job count '%d'! Use 0 to use the number of cores.", options.jobs);
+        validate_options(options, !request.contents.empty());
+        for(size_t i=0; i<request.inputs.size(); ++i)
+        {
+            const MakeIconInput& input = request.inputs[i];
+            if(!input.data || input.size == 0)
+                FAIL(MakeIconError_InvalidArgument, "No data provided for input: %s", options.input[i].c_str());
+            if((input.width > 0 || input.height > 0) && (input.width <= 0 || input.height <= 0 || input.size != CAST(size_t, input.width) * input.height * 4))
+                FAIL(MakeIconError_InvalidArgument, "Raw input '%s' must be %dx%d tightly packed RGBA pixels!", options.input[i].c_str(), input.width, input.height);
+        }
+
+        init_thread_pool(pool, options.jobs);
+        generate_icon(options, request.contents, input_files, context);
+    }
+    catch(const RunFailure& failure)
+    {
+        error = failure.error;
+        error_message = failure.message;
+    }
+    catch(const std::bad_alloc&)
+    {
+        error = MakeIconError_OutOfMemory;
+        error_message = "Out of memory!";
+    }
+    catch(const std::exception& exception)
+    {
+        error = MakeIconError_InvalidInput;
+        error_message = exception.what();
+    }
+    quit_thread_pool(pool);
+
+    if(error != MakeIconError_None)
+    {
+        if(message) *message = error_message;
+        return error;
+    }
+    for(auto& file: context.writer.files)
+    {
+        files.push_back(MakeIconFile { file.file_name, std::move(file.data) });
+    }
+    return MakeIconError_None;
+}
+
+const char* makeicon_error_name(MakeIconError error)
+{
+    static constexpr const char* ERROR_NAMES[MakeIconError_COUNT] =
+    {
+        "none", "invalid argument", "invalid input", "missing size", "out of memory", "encode failed", "write failed"
+    };
+    return (error >= 0 && error < MakeIconError_COUNT) ? ERROR_NAMES[error] : "unknown";
+}
+
+// The benchmark defines MAKEICON_BENCH to keep the argument parsing and the whole runs that it drives.
+#if !defined(MAKEICON_NO_MAIN) || defined(MAKEICON_BENCH)
+static Argument format_argument(std::string arg_str)
+{
+    // @Improve: Handle ill-formed argument error cases!
+
+    // Remove the '-' character from the argument.
+    arg_str.erase(0,1);
+    // Split the argument into its name and (optional) parameters.
+    std::vector<std::string> tokens;
+    tokenize_string(arg_str, ":", tokens);
+    // Store the formatted argument information.
+    Argument arg;
+    if(!tokens.empty())
+    {
+        arg.name = tokens[0];
+        if(tokens.size() > 1) // We have parameters!
+        {
+            tokenize_string(tokens[1], ",", arg.params);
+        }
+    }
+    return arg;
+}
+
+static s32 make_icon(const Options& options)
+{
+    // Tracing is only switched on for this thread and the tasks it queues, and only for the length of the run.
+    std::unique_ptr<Trace> trace;
+    if(options.stats || !options.trace.empty())
+    {
+        trace = std::make_unique<Trace>();
+        trace->threads.push_back(std::this_thread::get_id());
+        current_trace = trace.get();
+    }
+
+    ThreadPool pool;
+    init_thread_pool(pool, options.jobs);
+
+    s32 result = EXIT_FAILURE;
+    try
+    {
+        Context context { pool };
+        result = generate_icon_files(options, context);
+    }
+    catch(const RunFailure& failure)
+    {
+        ERROR("%s", failure.message.c_str());
+    }
+
+    quit_thread_pool(pool);
+    finish_trace(options, trace);
+    return result;
+}
+#endif
+
+// The benchmark and other programs that include this file define MAKEICON_NO_MAIN and provide their own main.
+#ifndef MAKEICON_NO_MAIN
+static void print_version_message()
+{
+    fprintf(stdout, "makeicon v%d.%d\n", MAKEICON_VERSION_MAJOR, MAKEICON_VERSION_MINOR);
+}
+
+static void print_help_message()
+{
+    fprintf(stdout, "%s\n", MAKEICON_HELP_MESSAGE);
+}
+
+// Applies a single option to the options, this is shared by the command line and the jobs of a manifest.
+static void parse_option(const Argument& arg, Options& options)
+{
+    if(arg.name == "resize")
+    {
+        options.resize = true;
+    }
+    else if(arg.name == "cascade")
+    {
+        options.cascade = true;
+    }
+    else if(arg.name == "linear")
+    {
+        options.linear = true;
+    }
+    else if(arg.name == "sizes")
+    {
+        for(auto& param: arg.params)
+        {
+            // allows sizes to be specified through a json file (used for apple icon generation)
+            if(param.find(".json") != -1) options.contents = param;
+            else options.sizes.push_back(std::stoi(param));
+        }
+        if(options.sizes.empty() && options.contents.empty())
+        {
+            FAIL(MakeIconError_InvalidArgument, "No sizes provided with -sizes argument!");
+        }
+    }
+    else if(arg.name == "input")
+    {
+        for(auto& param: arg.params)
+        {
+            if(std::filesystem::is_directory(param))
+            {
+                for(auto& p: std::filesystem::directory_iterator(param))
+                {
+                    if(std::filesystem::is_regular_file(p))
+                    {
+                        options.input.push_back(p.path().string());
+                    }
+                }
+            }
+            else
+            {
+                if(std::filesystem::path(param).extension() == ".txt")
+                {
+                   // If it's a text file we read each line and add those as file names for input.
+                    std::ifstream file(param);
+                    if(!file.is_open())
+                    {
+                        FAIL(MakeIconError_InvalidArgument, "Failed to read .txt file passed in as input: %s", param.c_str());
+                    }
+                    else
+                    {
+                        std::string line;
+                        while(getline(file, line))
+                        {
+                            if(std::filesystem::is_regular_file(line))
+                            {
+                                options.input.push_back(line);
+                            }
+                        }
+                    }
+                }
+                else
+                {
+                    options.input.push_back(param);
+                }
+            }
+        }
+        if(options.input.empty())
+        {
+            FAIL(MakeIconError_InvalidArgument, "No input provided with -input argument!");
+        }
+    }
+    else if(arg.name == "platform")
+    {
+        std::string platform = arg.params[0];
+        for(Platform i=0; i<Platform_COUNT; ++i)
+        {
+            if(platform == PLATFORM_NAMES[i])
+            {
+                options.platform = i;
+                break;
+            }
+        }
+    }
+    else if (arg.name == "padding")
+    {
+        for (auto& param : arg.params)
+        {
+            options.padding = std::stof(param);
+        }
+    }
+    else if (arg.name == "radius")
+    {
+        for (auto& param : arg.params)
+        {
+            options.radius = std::stof(param);
+        }
+    }
+    else if(arg.name == "jobs")
+    {
+        for(auto& param: arg.params)
+        {
+            options.jobs = std::stoi(param);
+        }
+        if(options.jobs < 0)
+        {
+            FAIL(MakeIconError_InvalidArgument, "Invalid job count '%d'! Use 0 to use the number of cores.", options.jobs);
+        }
+    }
+    else if(arg.name == "compression")
+    {
+        if(arg.params.empty())
+        {
+            FAIL(MakeIconError_InvalidArgument, "No level provided with -compression argument!");
+        }
+        options.compression = Compression_COUNT;
+        for(Compression i=0; i<Compression_COUNT; ++i)
+        {
+            if(arg.params[0] == COMPRESSION_NAMES[i])
+            {
+                options.compression = i;
+                break;
+            }
+        }
+        if(options.compression == Compression_COUNT)
+        {
+            FAIL(MakeIconError_InvalidArgument, "Unknown compression level: %s", arg.params[0].c_str());
+        }
+    }
+    else if(arg.name == "ico-format")
+    {
+        if(arg.params.empty())
+        {
+            FAIL(MakeIconError_InvalidArgument, "No format provided with -ico-format argument!");
+        }
+        options.ico_format = IcoFormat_COUNT;
+        for(IcoFormat i=0; i<IcoFormat_COUNT; ++i)
+        {
+            if(arg.params[0] == ICO_FORMAT_NAMES[i])
+            {
+                options.ico_format = i;
+                break;
+            }
+        }
+        if(options.ico_format == IcoFormat_COUNT)
+        {
+            FAIL(MakeIconError_InvalidArgument, "Unknown ico format: %s", arg.params[0].c_str());
+        }
+    }
+    else if(arg.name == "cache")
+    {
+        if(arg.params.empty())
+        {
+            FAIL(MakeIconError_InvalidArgument, "No directory provided with -cache argument!");
+        }
+        options.cache = arg.params[0];
+    }
+    else if(arg.name == "update")
+    {
+        options.update = true;
+    }
+    else if(arg.name == "dry-run")
+    {
+        options.dry_run = true;
+    }
+    else if(arg.name == "stats")
+    {
+        options.stats = true;
+    }
+    else if(arg.name == "trace")
+    {
+        if(arg.params.empty())
+        {
+            FAIL(MakeIconError_InvalidArgument, "No file provided with -trace argument!");
+        }
+        options.trace = arg.params[0];
+    }
+    else
+    {
+        FAIL(MakeIconError_InvalidArgument, "Unknown argument: %s", arg.name.c_str());
+    }
+}
+
+// A single line of a manifest, producing one or more targets from the same inputs.
+struct ManifestJob
+{
+    s32                      line = 0;
+    std::vector<Options>     targets;
+    std::vector<std::string> inputs; // Every input file of the targets, each listed once.
+    std::string              error;
+};
+
+// Splits a manifest line into arguments at whitespace, quotes can be used around arguments that contain spaces.
+static void split_manifest_line(const std::string& line, std::vector<std::string>& args)
+{
+    std::string arg;
+    bool quoted = false, started = false;
+    for(char c: line)
+    {
+        if(c == '"')
+        {
+            quoted = !quoted;
+            started = true;
+        }
+        else if(!quoted && isspace(CAST(u8, c)))
+        {
+            if(started) args.push_back(arg);
+            arg.clear();
+            started = false;
+        }
+        else
+        {
+            arg += c;
+            started = true;
+        }
+    }
+    if(started)
+    {
+        args.push_back(arg);
+    }
+}
+
+// Each line of a manifest is a makeicon command line, except that every output name ends a target so that one job
+// can produce several platforms. The options before an output carry over to the targets after it, apart from the
+// sizes which are replaced when given again. The options given on the command line are the defaults for every job.
+static void parse_manifest_job(const std::string& line, const Options& defaults, ManifestJob& job)
+{
+    std::vector<std::string> args;
+    split_manifest_line(line, args);
+
+    Options options = defaults;
+    bool replace_sizes = false;
+    for(size_t i=0; i<args.size(); ++i)
+    {
+        if(args[i][0] == '-')
+        {
+            Argument arg = format_argument(args[i]);
+            if(arg.name == "sizes" && replace_sizes)
+            {
+                options.sizes.clear();
+                options.contents.clear();
+                replace_sizes = false;
+            }
+            parse_option(arg, options);
+        }
+        else
+        {
+            options.output = args[i];
+            job.targets.push_back(options);
+            replace_sizes = true;
+        }
+    }
+    if(job.targets.empty())
+    {
+        FAIL(MakeIconError_InvalidArgument, "No output name provded! Specify output name like so: makeicon ... outputname.ico");
+    }
+    if(args.back()[0] == '-')
+    {
+        FAIL(MakeIconError_InvalidArgument, "Extra arguments after final '%s' parameter!", job.targets.back().output.c_str());
+    }
+
+    for(auto& target: job.targets)
+    {
+        std::sort(target.input.begin(), target.input.end());
+        for(auto& input: target.input)
+        {
+            if(std::find(job.inputs.begin(), job.inputs.end(), input) == job.inputs.end())
+            {
+                job.inputs.push_back(input);
+            }
+        }
+    }
+}
+
+// Runs every job of the manifest in a single process. The jobs are run in parallel on one shared pool and share the
+// images they decode and render through an image cache, but otherwise stay independent: a job that fails is reported
+// and the others carry on. Returns failure if any job failed.
+static s32 run_manifest(const std::string& file_name, const Options& defaults)
+{
+    std::ifstream file(file_name);
+    if(!file.is_open())
+    {
+        ERROR("Failed to read manifest file: %s", file_name.c_str());
+    }
+
+    std::vector<ManifestJob> jobs;
+    std::string line;
+    for(s32 line_number=1; getline(file, line); ++line_number)
+    {
+        size_t first = line.find_first_not_of(" \t\r");
+        if(first == std::string::npos || line[first] == '#')
+        {
+            continue; // Skip blank lines and comments.
+        }
+        ManifestJob job;
+        job.line = line_number;
+        try
+        {
+            parse_manifest_job(line, defaults, job);
+        }
+        catch(const RunFailure& failure)
+        {
+            job.error = failure.message;
+        }
+        catch(const std::exception& exception)
+        {
+            job.error = exception.what();
+        }
+        jobs.push_back(job);
+    }
+
+    std::unique_ptr<Trace> trace;
+    if(defaults.stats || !defaults.trace.empty())
+    {
+        trace = std::make_unique<Trace>();
+        trace->threads.push_back(std::this_thread::get_id());
+        current_trace = trace.get();
+    }
+
+    ThreadPool pool;
+    init_thread_pool(pool, defaults.jobs);
+
+    ImageCache cache;
+    for(auto& job: jobs)
+    {
+        if(job.error.empty()) add_shared_source_users(cache, job.inputs);
+    }
+
+    parallel_for(pool, jobs.size(), [&](size_t j)
+    {
+        ManifestJob& job = jobs[j];
+        if(!job.error.empty())
+        {
+            return;
+        }
+        TraceScope scope("manifest");
+        if(scope.trace) scope.event.detail = file_name + ":" + std::to_string(job.line);
+        try
+        {
+            for(auto& target: job.targets)
+            {
+                Context context { pool };
+                context.cache = &cache;
+                generate_icon_files(target, context);
+            }
+        }
+        catch(const RunFailure& failure)
+        {
+            job.error = failure.message;
+        }
+        catch(const std::exception& exception)
+        {
+            job.error = exception.what();
+        }
+        release_shared_sources(cache, job.inputs);
+    });
+
+    quit_thread_pool(pool);
+    finish_trace(defaults, trace);
+
+    s32 failed = 0;
+    for(auto& job: jobs)
+    {
+        if(!job.error.empty())
+        {
+            fprintf(stderr, "[makeicon] error: %s:%d: %s\n", file_name.c_str(), job.line, job.error.c_str());
+            ++failed;
+        }
+    }
+    if(failed > 0)
+    {
+        fprintf(stderr, "[makeicon] %d of %zu manifest jobs failed\n", failed, jobs.size());
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// In watch mode the process stays up after the first run and runs again whenever one of its inputs changes. Every
+// decoded source and every rendered and encoded icon stays in an image cache between runs, only the sources that
+// changed are dropped from it, so a run only decodes, renders and encodes what depends on those files. Outputs whose
+// bytes come out the same are not written again. Changes are picked up with inotify on Linux and by polling the
+// modification times elsewhere.
+static constexpr s32 WATCH_DEBOUNCE_MS = 100; // How long the inputs have to be left alone before running again.
+
+struct WatchState
+{
+    std::vector<std::string> input_params; // The -input parameters as given, expanded again before every run.
+    std::set<std::string>    files;        // Every file the outputs depend on, including .txt lists and the contents json.
+    std::set<std::string>    directories;  // Input directories, where files that are added or removed count as well.
+    std::string              output;       // Changes under the output are our own writes.
+#if defined(__linux__)
+    s32                        inotify = -1;
+    std::map<s32, std::string> watches;    // The directory of each inotify watch.
+#else
+    std::map<std::string, std::filesystem::file_time_type> times;
+#endif
+};
+
+// Our own writes are the output itself, anything inside of it when it's a directory, and the temporary and .mkf
+// sidecar files written next to it. Inputs can share a prefix with the output (icon.png next to icon) and still count.
+static bool is_watch_output(const WatchState& watch, const std::string& file_name)
+{
+    if(file_name.compare(0, watch.output.size(), watch.output) != 0)
+    {
+        return false;
+    }
+    std::string suffix = file_name.substr(watch.output.size());
+    if(suffix.empty() || suffix[0] == '/' || suffix[0] == CAST(char, std::filesystem::path::preferred_separator) || suffix == ".mkf")
+    {
+        return true;
+    }
+    return (suffix.compare(0, 4, ".tmp") == 0 && suffix.size() > 4 && suffix.find_first_not_of("0123456789", 4) == std::string::npos);
+}
+
+static bool is_watched_change(const WatchState& watch, const std::string& file_name)
+{
+    if(is_watch_output(watch, file_name))
+    {
+        return false;
+    }
+    std::string directory = std::filesystem::path(file_name).parent_path().string();
+    return (watch.files.count(file_name) > 0 || watch.directories.count(directory) > 0);
+}
+
+#if !defined(__linux__)
+static void get_watch_times(const WatchState& watch, std::map<std::string, std::filesystem::file_time_type>& times)
+{
+    std::error_code error;
+    for(auto& file_name: watch.files)
+    {
+        auto time = std::filesystem::last_write_time(file_name, error);
+        if(!error) times[file_name] = time;
+    }
+    for(auto& directory: watch.directories)
+    {
+        for(auto& p: std::filesystem::directory_iterator(directory, error))
+        {
+            std::string file_name = get_shared_source_name(p.path().string());
+            auto time = std::filesystem::last_write_time(p.path(), error);
+            if(!error && is_watched_change(watch, file_name)) times[file_name] = time;
+        }
+    }
+}
+#endif
+
+// Works out what the options depend on and starts watching any of it that isn't watched yet. Files are watched
+// through their directory so that editors which save by replacing the file are still picked up.
+static void update_watch_paths(const Options& options, WatchState& watch)
+{
+    watch.files.clear();
+    watch.directories.clear();
+    std::vector<std::string> file_names = options.input;
+    if(!options.contents.empty())
+    {
+        file_names.push_back(options.contents);
+    }
+    for(auto& param: watch.input_params)
+    {
+        if(std::filesystem::is_directory(param)) watch.directories.insert(get_shared_source_name(param));
+        else file_names.push_back(param);
+    }
+    for(auto& file_name: file_names)
+    {
+        watch.files.insert(get_shared_source_name(file_name));
+    }
+
+#if defined(__linux__)
+    std::set<std::string> directories = watch.directories;
+    for(auto& file_name: watch.files)
+    {
+        directories.insert(std::filesystem::path(file_name).parent_path().string());
+    }
+    for(auto& directory: directories)
+    {
+        u32 mask = IN_CLOSE_WRITE|IN_MOVED_TO|IN_MOVED_FROM|IN_CREATE|IN_DELETE;
+        s32 wd = inotify_add_watch(watch.inotify, directory.c_str(), mask);
+        if(wd < 0)
+        {
+            WARNING("Failed to watch directory: %s", directory.c_str());
+            continue;
+        }
+        watch.watches[wd] = directory;
+    }
+#else
+    watch.times.clear();
+    get_watch_times(watch, watch.times);
+#endif
+}
+
+// Blocks until something the outputs depend on has changed and then nothing has changed for the debounce time, so
+// a burst of saves results in a single run. The paths that changed are added to changed.
+static void wait_for_changes(WatchState& watch, std::set<std::string>& changed)
+{
+#if defined(__linux__)
+    alignas(struct inotify_event) char buffer[4096];
+    while(true)
+    {
+        pollfd fd = { watch.inotify, POLLIN, 0 };
+        s32 ready = poll(&fd, 1, (changed.empty()) ? -1 : WATCH_DEBOUNCE_MS);
+        if(ready < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(ready < 0)
+        {
+            ERROR("Failed to wait for changes to the inputs!");
+        }
+        if(ready == 0)
+        {
+            return;
+        }
+
+        ssize_t size = read(watch.inotify, buffer, sizeof(buffer));
+        for(char* at = buffer; size > 0 && at < buffer + size; )
+        {
+            const struct inotify_event* event = CAST(const struct inotify_event*, at);
+            at += sizeof(struct inotify_event) + event->len;
+            if(event->mask & IN_Q_OVERFLOW)
+            {
+                // Events were lost, so treat everything as changed.
+                changed.insert(watch.files.begin(), watch.files.end());
+                continue;
+            }
+            auto directory = watch.watches.find(event->wd);
+            if(directory == watch.watches.end() || event->len == 0)
+            {
+                continue;
+            }
+            std::string file_name = get_shared_source_name(directory->second + "/" + event->name);
+            if(is_watched_change(watch, file_name))
+            {
+                changed.insert(file_name);
+            }
+        }
+    }
+#else
+    while(true)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_DEBOUNCE_MS));
+        std::map<std::string, std::filesystem::file_time_type> times;
+        get_watch_times(watch, times);
+        size_t count = changed.size();
+        for(auto& time: times)
+        {
+            auto it = watch.times.find(time.first);
+            if(it == watch.times.end() || it->second != time.second) changed.insert(time.first);
+        }
+        for(auto& time: watch.times)
+        {
+            if(times.count(time.first) == 0) changed.insert(time.first);
+        }
+        watch.times.swap(times);
+        if(!changed.empty() && changed.size() == count)
+        {
+            return;
+        }
+    }
+#endif
+}
+
+static s32 run_watch(const Options& options, const std::vector<std::string>& input_params)
+{
+    ThreadPool pool;
+    init_thread_pool(pool, options.jobs);
+
+    WatchState watch;
+    watch.input_params = input_params;
+    watch.output = get_shared_source_name(options.output);
+    while(watch.output.size() > 1 && (watch.output.back() == '/' || watch.output.back() == CAST(char, std::filesystem::path::preferred_separator)))
+    {
+        watch.output.pop_back();
+    }
+#if defined(__linux__)
+    watch.inotify = inotify_init1(IN_CLOEXEC);
+    if(watch.inotify < 0)
+    {
+        ERROR("Failed to start watching the inputs!");
+    }
+#endif
+
+    ImageCache cache;
+    std::set<std::string> changed;
+    while(true)
+    {
+        // Directories and .txt lists are expanded again so that files added to them are picked up.
+        Options run = options;
+        auto start = std::chrono::steady_clock::now();
+        try
+        {
+            if(!input_params.empty())
+            {
+                run.input.clear();
+                parse_option(Argument { "input", input_params }, run);
+                std::sort(run.input.begin(), run.input.end());
+            }
+
+            // Only the sources that changed or are no longer used are dropped, the rest are reused as they are.
+            std::set<std::string> inputs;
+            for(auto& file_name: run.input)
+            {
+                inputs.insert(get_shared_source_name(file_name));
+            }
+            std::vector<std::string> evicted(changed.begin(), changed.end());
+            for(auto& source: cache.sources)
+            {
+                if(inputs.count(source.first) == 0) evicted.push_back(source.first);
+            }
+            for(auto& file_name: evicted)
+            {
+                evict_shared_source(cache, file_name);
+            }
+
+            std::unique_ptr<Trace> trace;
+            if(run.stats || !run.trace.empty())
+            {
+                trace = std::make_unique<Trace>();
+                trace->threads.push_back(std::this_thread::get_id());
+                current_trace = trace.get();
+            }
+            try
+            {
+                Context context { pool };
+                context.cache = &cache;
+                generate_icon_files(run, context);
+            }
+            catch(...)
+            {
+                finish_trace(run, trace);
+                throw;
+            }
+            finish_trace(run, trace);
+
+            f64 ms = std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - start).count();
+            fprintf(stdout, "[makeicon] built %s in %.1fms (%zu changed)\n", run.output.c_str(), ms, changed.size());
+        }
+        catch(const RunFailure& failure)
+        {
+            fprintf(stderr, "[makeicon] error: %s\n", failure.message.c_str());
+        }
+        catch(const std::exception& exception)
+        {
+            fprintf(stderr, "[makeicon] error: %s\n", exception.what());
+        }
+        fflush(stdout);
+
+        update_watch_paths(run, watch);
+        changed.clear();
+        wait_for_changes(watch, changed);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// Everything on a command line, the options for generating an icon along with the ones that pick what to run.
+struct CommandLine
+{
+    Options                  options;
+    bool                     version = false;
+    bool                     help    = false;
+    std::string              manifest;
+    bool                     watch   = false;
+    std::vector<std::string> input_params; // The -input parameters as given, for watch mode.
+    std::string              serve;
+};
+
+// Parses the arguments that follow the program name, failures are thrown so a server can report them per request.
+static void parse_command_line(const std::vector<std::string>& args, CommandLine& command)
+{
+    Options& options = command.options;
+    for(size_t i=0; i<args.size(); ++i)
+    {
+        // Handle options.
+        if(!args[i].empty() && args[i][0] == '-')
+        {
+            Argument arg = format_argument(args[i]);
+            if(arg.name == "version")
+            {
+                command.version = true;
+                return;
+            }
+            else if(arg.name == "help")
+            {
+                command.help = true;
+                return;
+            }
+            else if(arg.name == "manifest")
+            {
+                if(arg.params.empty())
+                {
+                    FAIL(MakeIconError_InvalidArgument, "No file provided with -manifest argument!");
+                }
+                command.manifest = arg.params[0];
+            }
+            else if(arg.name == "watch")
+            {
+                command.watch = true;
+            }
+            else if(arg.name == "serve")
+            {
+                if(arg.params.empty())
+                {
+                    FAIL(MakeIconError_InvalidArgument, "No socket path provided with -serve argument!");
+                }
+                command.serve = arg.params[0];
+            }
+            else
+            {
+                if(arg.name == "input")
+                {
+                    command.input_params.insert(command.input_params.end(), arg.params.begin(), arg.params.end());
+                }
+                parse_option(arg, options);
+            }
+        }
+        else // Handle output.
+        {
+            // If there are still arguments/options after the final output name parameter then we consider
+            // the input ill-formed and we inform the user of how to format the arguments to the program.
+            if(i < (args.size()-1))
+            {
+                FAIL(MakeIconError_InvalidArgument, "Extra arguments after final '%s' parameter!", args[i].c_str());
+            }
+            else
+            {
+                options.output = args[i];
+            }
+        }
+    }
+
+    // Sort the input file names so that inputs are always processed in a stable order, the images themselves are
+    // ordered by size once their dimensions are known.
+    std::sort(options.input.begin(), options.input.end());
+}
+
+// A server runs requests sent over a Unix domain socket by -client, each request being the arguments of a makeicon
+// command line. Requests run concurrently on one thread pool and share an image cache that lives as long as the
+// server, so sources that keep being used are decoded once and their icons are rendered and encoded once. A
+// request that fails gets its error back, it never brings the server down.
+//
+// Every message is made of u32 values in native byte order, which is fine as both ends are on the same machine.
+// Strings are sent as their u32 size followed by their bytes. A request is the number of arguments followed by the
+// arguments. A reply is the status (a MakeIconError), a message (the error, or the help or version text) and the
+// -stats output of the request. A connection can send any number of requests, each gets its reply in turn.
+static constexpr u32    SERVE_MAX_ARGS     = 4096;
+static constexpr u32    SERVE_MAX_STRING   = 1 << 20;
+static constexpr size_t SERVE_CACHE_BUDGET = CAST(size_t, 1) << 30; // Cached images past this many bytes are dropped.
+
+struct ServeReply
+{
+    u32         status = MakeIconError_None;
+    std::string message;
+    std::string stats;
+};
+
+#if !defined(_WIN32)
+static bool read_socket(s32 fd, void* data, size_t size)
+{
+    u8* at = CAST(u8*, data);
+    while(size > 0)
+    {
+        ssize_t bytes = read(fd, at, size);
+        if(bytes < 0 && errno == EINTR) continue;
+        if(bytes <= 0) return false;
+        at += bytes;
+        size -= bytes;
+    }
+    return true;
+}
+
+static bool write_socket(s32 fd, const void* data, size_t size)
+{
+    const u8* at = CAST(const u8*, data);
+    while(size > 0)
+    {
+        ssize_t bytes = write(fd, at, size);
+        if(bytes < 0 && errno == EINTR) continue;
+        if(bytes <= 0) return false;
+        at += bytes;
+        size -= bytes;
+    }
+    return true;
+}
+
+static bool read_socket_string(s32 fd, std::string& str)
+{
+    u32 size = 0;
+    if(!read_socket(fd, &size, sizeof(size)) || size > SERVE_MAX_STRING)
+    {
+        return false;
+    }
+    str.resize(size);
+    return read_socket(fd, &str[0], size);
+}
+
+static bool write_socket_string(s32 fd, const std::string& str)
+{
+    u32 size = CAST(u32, str.size());
+    return write_socket(fd, &size, sizeof(size)) && write_socket(fd, str.data(), str.size());
+}
+
+static bool connect_socket(s32 fd, const std::string& socket_path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path)-1);
+    return (connect(fd, CAST(sockaddr*, &address), sizeof(address)) == 0);
+}
+
+// State shared by every request of a server.
+struct ServeState
+{
+    ThreadPool&             pool;
+    const Options&          defaults; // The options given to the server, each request's arguments are applied on top.
+    ImageCache              cache;
+    std::mutex              mutex;
+    std::condition_variable idle;
+    s32                     running  = 0;
+    bool                    flushing = false; // Set while a request waits to drop sources, no others start meanwhile.
+    std::map<std::string, std::pair<uintmax_t, std::filesystem::file_time_type>> stamps; // Size and time of each cached source.
+    ServeState(ThreadPool& thread_pool, const Options& options): pool(thread_pool), defaults(options) {}
+};
+
+static size_t get_shared_cache_size(ImageCache& cache)
+{
+    auto get_size = [](const Image& image) { return (image.data) ? CAST(size_t, image.width) * image.height * image.bpp : 0; };
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    size_t size = 0;
+    for(auto& source: cache.sources)
+    {
+        size += get_size(source.second.image);
+        for(auto& render: source.second.renders) size += get_size(render.second);
+        for(auto& encoding: source.second.encodings) size += encoding.second.size();
+    }
+    return size;
+}
+
+// Checks that the cached sources of a request are still what is on disk before it runs. Sources whose file has
+// changed are dropped from the cache, or everything once the cache has grown past its budget. That has to wait until
+// no other request is running as they may be using them.
+static void begin_serve_request(ServeState& server, const Options& options)
+{
+    std::map<std::string, std::pair<uintmax_t, std::filesystem::file_time_type>> stamps;
+    for(auto& file_name: options.input)
+    {
+        std::error_code error;
+        std::string name = get_shared_source_name(file_name);
+        stamps[name] = std::make_pair(std::filesystem::file_size(name, error), std::filesystem::last_write_time(name, error));
+    }
+
+    std::unique_lock<std::mutex> lock(server.mutex);
+    server.idle.wait(lock, [&]() { return !server.flushing; });
+    std::vector<std::string> stale;
+    for(auto& stamp: stamps)
+    {
+        auto it = server.stamps.find(stamp.first);
+        if(it != server.stamps.end() && it->second != stamp.second) stale.push_back(stamp.first);
+    }
+    bool full = (get_shared_cache_size(server.cache) > SERVE_CACHE_BUDGET);
+    if(!stale.empty() || full)
+    {
+        server.flushing = true;
+        server.idle.wait(lock, [&]() { return server.running == 0; });
+        if(full)
+        {
+            stale.clear();
+            for(auto& stamp: server.stamps) stale.push_back(stamp.first);
+        }
+        for(auto& name: stale)
+        {
+            evict_shared_source(server.cache, name);
+            server.stamps.erase(name);
+        }
+        server.flushing = false;
+        server.idle.notify_all();
+    }
+    server.stamps.insert(stamps.begin(), stamps.end());
+    server.running++;
+}
+
+static void end_serve_request(ServeState& server)
+{
+    std::lock_guard<std::mutex> lock(server.mutex);
+    if(--server.running == 0) server.idle.notify_all();
+}
+
+static ServeReply run_serve_request(ServeState& server, const std::vector<std::string>& args)
+{
+    // Every request is traced so its stats can be sent back, the trace follows its tasks onto the pool's threads.
+    std::unique_ptr<Trace> trace = std::make_unique<Trace>();
+    trace->threads.push_back(std::this_thread::get_id());
+    current_trace = trace.get();
+
+    ServeReply reply;
+    CommandLine command;
+    command.options = server.defaults;
+    try
+    {
+        parse_command_line(args, command);
+        if(command.version)
+        {
+            reply.message = "makeicon v" + std::to_string(MAKEICON_VERSION_MAJOR) + "." + std::to_string(MAKEICON_VERSION_MINOR) + "\n";
+        }
+        else if(command.help)
+        {
+            reply.message = std::string(MAKEICON_HELP_MESSAGE) + "\n";
+        }
+        else
+        {
+            if(!command.manifest.empty() || command.watch || !command.serve.empty())
+            {
+                FAIL(MakeIconError_InvalidArgument, "The -manifest, -watch and -serve options can't be sent to a server!");
+            }
+            begin_serve_request(server, command.options);
+            try
+            {
+                Context context { server.pool };
+                context.cache = &server.cache;
+                generate_icon_files(command.options, context);
+            }
+            catch(...)
+            {
+                end_serve_request(server);
+                throw;
+            }
+            end_serve_request(server);
+        }
+    }
+    catch(const RunFailure& failure)
+    {
+        reply.status = failure.error;
+        reply.message = failure.message;
+    }
+    catch(const std::bad_alloc&)
+    {
+        reply.status = MakeIconError_OutOfMemory;
+        reply.message = "Out of memory!";
+    }
+    catch(const std::exception& exception)
+    {
+        reply.status = MakeIconError_InvalidArgument;
+        reply.message = exception.what();
+    }
+
+    current_trace = NULL;
+    reply.stats = format_trace_stats(*trace);
+    if(!command.options.trace.empty() && !save_trace(*trace, command.options.trace))
+    {
+        WARNING("Failed to save trace file: %s", command.options.trace.c_str());
+    }
+    return reply;
+}
+
+static void serve_connection(ServeState& server, s32 fd)
+{
+    while(true)
+    {
+        u32 count = 0;
+        if(!read_socket(fd, &count, sizeof(count)) || count > SERVE_MAX_ARGS)
+        {
+            break;
+        }
+        std::vector<std::string> args(count);
+        bool received = true;
+        for(auto& arg: args)
+        {
+            received = received && read_socket_string(fd, arg);
+        }
+        if(!received)
+        {
+            break;
+        }
+
+        ServeReply reply = run_serve_request(server, args);
+        if(!write_socket(fd, &reply.status, sizeof(reply.status)) || !write_socket_string(fd, reply.message) || !write_socket_string(fd, reply.stats))
+        {
+            break;
+        }
+    }
+    close(fd);
+}
+
+static char serve_socket_path[sizeof(sockaddr_un::sun_path)];
+
+static void stop_serving(s32)
+{
+    unlink(serve_socket_path);
+    _exit(EXIT_SUCCESS);
+}
+
+static s32 run_serve(const std::string& socket_path, const Options& defaults)
+{
+    if(socket_path.size() >= sizeof(serve_socket_path))
+    {
+        ERROR("Socket path is too long: %s", socket_path.c_str());
+    }
+    s32 listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0)
+    {
+        ERROR("Failed to create socket: %s", socket_path.c_str());
+    }
+
+    // A socket left behind by a server that was killed is replaced, one that a server is still listening on is not.
+    struct stat info;
+    if(lstat(socket_path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+    {
+        s32 probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool live = (probe >= 0 && connect_socket(probe, socket_path));
+        if(probe >= 0) close(probe);
+        if(live)
+        {
+            ERROR("A server is already listening on: %s", socket_path.c_str());
+        }
+        unlink(socket_path.c_str());
+    }
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path)-1);
+    if(bind(listener, CAST(sockaddr*, &address), sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+    {
+        ERROR("Failed to listen on socket: %s", socket_path.c_str());
+    }
+    strncpy(serve_socket_path, socket_path.c_str(), sizeof(serve_socket_path)-1);
+    signal(SIGPIPE, SIG_IGN); // A client that goes away is noticed by the failed write instead.
+    signal(SIGINT, stop_serving);
+    signal(SIGTERM, stop_serving);
+
+    ThreadPool pool;
+    init_thread_pool(pool, defaults.jobs);
+    ServeState server { pool, defaults };
+
+    fprintf(stdout, "[makeicon] serving on %s\n", socket_path.c_str());
+    fflush(stdout);
+    while(true)
+    {
+        s32 fd = accept(listener, NULL, NULL);
+        if(fd < 0)
+        {
+            if(errno != EINTR && errno != ECONNABORTED)
+            {
+                WARNING("Failed to accept connection on: %s", socket_path.c_str());
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            continue;
+        }
+        // Connections only wait on their socket and on the pool, the work itself is done by the pool's threads.
+        std::thread([&server, fd]() { serve_connection(server, fd); }).detach();
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// The server has its own working directory, so every path in the arguments is made absolute before sending them.
+static std::string get_client_argument(const std::string& arg)
+{
+    auto get_path = [](const std::string& file_name)
+    {
+        std::error_code error;
+        std::filesystem::path path = std::filesystem::absolute(file_name, error);
+        return (error) ? file_name : path.string();
+    };
+    if(arg.empty() || arg[0] != '-')
+    {
+        return get_path(arg);
+    }
+
+    Argument parsed = format_argument(arg);
+    bool paths = (parsed.name == "input" || parsed.name == "cache" || parsed.name == "trace");
+    if(parsed.params.empty() || (!paths && parsed.name != "sizes"))
+    {
+        return arg;
+    }
+    std::string result = "-" + parsed.name;
+    for(size_t i=0; i<parsed.params.size(); ++i)
+    {
+        const std::string& param = parsed.params[i];
+        result += (i == 0) ? ":" : ",";
+        result += (paths || param.find(".json") != std::string::npos) ? get_path(param) : param;
+    }
+    return result;
+}
+
+static s32 run_client(const std::string& socket_path, const std::vector<std::string>& args)
+{
+    s32 fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || !connect_socket(fd, socket_path))
+    {
+        ERROR("Failed to connect to server: %s", socket_path.c_str());
+    }
+
+    bool stats = false;
+    u32 count = CAST(u32, args.size());
+    bool sent = write_socket(fd, &count, sizeof(count));
+    for(auto& arg: args)
+    {
+        sent = sent && write_socket_string(fd, get_client_argument(arg));
+        stats = stats || (arg == "-stats");
+    }
+
+    ServeReply reply;
+    if(!sent || !read_socket(fd, &reply.status, sizeof(reply.status)) || !read_socket_string(fd, reply.message) || !read_socket_string(fd, reply.stats))
+    {
+        ERROR("Lost the connection to server: %s", socket_path.c_str());
+    }
+    close(fd);
+
+    if(reply.status != MakeIconError_None)
+    {
+        fprintf(stderr, "[makeicon] error: %s\n", reply.message.c_str());
+        return EXIT_FAILURE;
+    }
+    fputs(reply.message.c_str(), stdout);
+    if(stats)
+    {
+        fputs(reply.stats.c_str(), stdout);
+    }
+    return EXIT_SUCCESS;
+}
+#else
+static s32 run_serve(const std::string& socket_path, const Options& defaults)
+{
+    ERROR("The -serve option is not supported on this platform!");
+}
+
+static s32 run_client(const std::string& socket_path, const std::vector<std::string>& args)
+{
+    ERROR("The -client option is not supported on this platform!");
+}
+#endif
+
+int main(int argc, char** argv)
+{
     // test command line: -input:./icon.png -sizes:256,128,64,32 -resize ./icon.ico
 
     // Parse command line arguments given to the program, if there are not
@@ -450,158 +5535,83 @@ int main(int argc, char** argv)
         print_help_message();
         return EXIT_SUCCESS;
     }
-    else
+
+    // A client passes its arguments on to a server untouched, apart from making the paths absolute.
+    std::vector<std::string> args(argv+1, argv+argc);
+    for(size_t i=0; i<args.size(); ++i)
     {
-        for(s32 i=1; i<argc; ++i)
+        if(args[i][0] != '-')
         {
-            // Handle options.
-            if(argv[i][0] == '-')
-            {
-                Argument arg = format_argument(argv[i]);
-                if(arg.name == "resize")
-                {
-                    options.resize = true;
-                }
-                else if(arg.name == "sizes")
-                {
-                    for(auto& param: arg.params)
-                    {
-                        // allows sizes to be specified through a json file (used for apple icon generation)
-                        if(param.find(".json") != -1) options.contents = param;
-                        else options.sizes.push_back(std::stoi(param));
-                    }
-                    if(options.sizes.empty() && options.contents.empty())
-                    {
-                        ERROR("No sizes provided with -sizes argument!");
-                    }
-                }
-                else if(arg.name == "input")
-                {
-                    for(auto& param: arg.params)
-                    {
-                        if(std::filesystem::is_directory(param))
-                        {
-                            for(auto& p: std::filesystem::directory_iterator(param))
-                            {
-                                if(std::filesystem::is_regular_file(p))
-                                {
-                                    options.input.push_back(p.path().string());
-                                }
-                            }
-                        }
-                        else
-                        {
-                            if(std::filesystem::path(param).extension() == ".txt")
-                            {
-                               // If it's a text file we read each line and add those as file names for input.
-                                std::ifstream file(param);
-                                if(!file.is_open())
-                                {
-                                    ERROR("Failed to read .txt file passed in as input: %s", param.c_str());
-                                }
-                                else
-                                {
-                                    std::string line;
-                                    while(getline(file, line))
-                                    {
-                                        if(std::filesystem::is_regular_file(line))
-                                        {
-                                            options.input.push_back(line);
-                                        }
-                                    }
-                                }
-                            }
-                            else
-                            {
-                                options.input.push_back(param);
-                            }
-                        }
-                    }
-                    if(options.input.empty())
-                    {
-                        ERROR("No input provided with -input argument!");
-                    }
-                }
-                else if(arg.name == "platform")
-                {
-                    std::string platform = arg.params[0];
-                    for(Platform i=0; i<Platform_COUNT; ++i)
-                    {
-                        if(platform == PLATFORM_NAMES[i])
-                        {
-                            options.platform = i;
-                            break;
-                        }
-                    }
-                }
-                else if (arg.name == "padding")
-                {
-                    for (auto& param : arg.params)
-                    {
-                        options.padding = std::stof(param);
-                    }
-                }
-                else if (arg.name == "radius")
-                {
-                    for (auto& param : arg.params)
-                    {
-                        options.radius = std::stof(param);
-                    }
-                }
-                else if(arg.name == "version")
-                {
-                    print_version_message();
-                    return EXIT_SUCCESS;
-                }
-                else if(arg.name == "help")
-                {
-                    print_help_message();
-                    return EXIT_SUCCESS;
-                }
-                else
-                {
-                    ERROR("Unknown argument: %s", arg.name.c_str());
-                }
-            }
-            else // Handle output.
+            continue;
+        }
+        Argument arg = format_argument(args[i]);
+        if(arg.name == "client")
+        {
+            if(arg.params.empty())
             {
-                // If there are still arguments/options after the final output name parameter then we consider
-                // the input ill-formed and we inform the user of how to format the arguments to the program.
-                if(i < (argc-1))
-                {
-                    ERROR("Extra arguments after final '%s' parameter!", argv[i]);
-                }
-                else
-                {
-                    options.output = argv[i];
-                }
+                ERROR("No socket path provided with -client argument!");
             }
+            args.erase(args.begin() + i);
+            return run_client(arg.params[0], args);
         }
     }
 
-    // Ensure the options structure is populated with valid data. If there are no inputs, sizes, or ouput we cannot run!
-    if(options.sizes.empty() && options.contents.empty())
-        ERROR("No icon sizes provided! Specify sizes using: -sizes:x,y,z,w...");
-    if(options.input.empty())
-        ERROR("No input images provided! Specify input using: -input:x,y,z,w...");
-    if(options.output.empty())
-        ERROR("No output name provded! Specify output name like so: makeicon ... outputname.ico");
+    CommandLine command;
+    try
+    {
+        parse_command_line(args, command);
+    }
+    catch(const RunFailure& failure)
+    {
+        ERROR("%s", failure.message.c_str());
+    }
+    const Options& options = command.options;
 
-    // The maximum size allows in an ICO file is 256x256! We also check for 0 or less as that would not be valid either...
-    for(auto& size: options.sizes)
+    if(command.version)
     {
-        if(size > 256)
-            ERROR("Invalid icon size '%d'! Maximum value allowed is 256 pixels.", size);
-        if(size <= 0)
-            ERROR("Invalid icon size '%d'! Minimum value allowed is 1 pixel.", size);
+        print_version_message();
+        return EXIT_SUCCESS;
+    }
+    if(command.help)
+    {
+        print_help_message();
+        return EXIT_SUCCESS;
     }
 
-    // Sort the input images from largest to smallest.
-    std::sort(options.input.begin(), options.input.end());
+    // A server takes its work from the requests it is sent.
+    if(!command.serve.empty())
+    {
+        if(!options.output.empty() || !options.input.empty() || !command.manifest.empty() || command.watch)
+        {
+            ERROR("Inputs, outputs, -manifest and -watch can't be given with -serve, they are sent with each request!");
+        }
+        return run_serve(command.serve, options);
+    }
+
+    // Every job in a manifest names its own outputs, anything else on the command line applies to all of them.
+    if(!command.manifest.empty())
+    {
+        if(!options.output.empty())
+        {
+            ERROR("No output name can be given with -manifest, the jobs in the manifest name their own outputs!");
+        }
+        if(command.watch)
+        {
+            ERROR("The -watch option can't be used with -manifest!");
+        }
+        return run_manifest(command.manifest, options);
+    }
+
+    if(command.watch)
+    {
+        return run_watch(options, command.input_params);
+    }
 
-    // Takes the populated options structure and uses those options to generate an icon for the desired platform.
+    // Takes the populated options structure and uses those options to generate an icon for the desired platform,
+    // after checking that it has been populated with everything that is needed to run.
     return make_icon(options);
 }
+#endif // MAKEICON_NO_MAIN
 
 //
 // Windows
@@ -625,6 +5635,23 @@ struct IconDir
 };
 #pragma pack(pop)
 
+#pragma pack(push,1)
+struct BitmapInfoHeader
+{
+    u32 size;
+    s32 width;
+    s32 height; // Covers both the XOR and AND masks, so twice the icon height.
+    u16 planes;
+    u16 bit_count;
+    u32 compression;
+    u32 size_image;
+    s32 x_pels_per_meter;
+    s32 y_pels_per_meter;
+    u32 clr_used;
+    u32 clr_important;
+};
+#pragma pack(pop)
+
 #pragma pack(push,1)
 struct IconDirEntry
 {
@@ -639,28 +5666,228 @@ struct IconDirEntry
 };
 #pragma pack(pop)
 
-s32 make_icon_win32(const Options& options, const std::vector<Image>& input_images)
+// With -update the fingerprint of every entry is kept in a sidecar file next to the .ico, along with a hash of the
+// .ico it describes. The next update only renders the entries whose fingerprint changed and copies the others
+// straight out of the existing file, if the .ico was changed by anything else then everything is rendered again.
+
+static constexpr u32 ICO_UPDATE_MAGIC   = 0x46494B4D; // "MKIF"
+static constexpr u32 ICO_UPDATE_VERSION = 1;
+
+static std::string get_ico_update_file_name(const Options& options)
+{
+    return options.output + ".mkf";
+}
+
+static bool use_dib_entry(const Options& options, s32 size);
+
+// Works out the fingerprint of every requested entry from the input headers and contents, without decoding
+// anything, and picks out the entries of the existing .ico that are still up to date.
+static void prepare_ico_update(const Options& options, const std::vector<MappedFile>& input_files, Context& context, IcoUpdate& update)
+{
+    std::vector<Image> input_images;
+    std::vector<size_t> files;
+    probe_input_images(options, input_files, context, input_images, files);
+    RenderPlan plan;
+    plan_renders(options, input_images, options.sizes, true, plan);
+
+    std::vector<u64> source_hashes(input_images.size(), 0);
+    parallel_for(context.pool, plan.keys.size(), [&](size_t k)
+    {
+        // Keys that share a source are hashed by the first of them only.
+        s32 source = plan.keys[k].source;
+        for(size_t j=0; j<k; ++j)
+        {
+            if(plan.keys[j].source == source) return;
+        }
+        const MappedFile& file = input_files[files[source]];
+        source_hashes[source] = hash_bytes(file.data, file.size);
+    });
+
+    size_t count = options.sizes.size();
+    update.fingerprints.resize(count);
+    update.blobs.resize(count);
+    for(size_t i=0; i<count; ++i)
+    {
+        const RenderKey& key = plan.keys[plan.outputs[i]];
+        const Image& source = input_images[key.source];
+        u64 hash = hash_value(0, ICO_UPDATE_VERSION);
+        hash = hash_value(hash, CAST(s32, MAKEICON_VERSION_MAJOR));
+        hash = hash_value(hash, CAST(s32, MAKEICON_VERSION_MINOR));
+        hash = hash_value(hash, source_hashes[key.source]);
+        hash = hash_value(hash, source.width);
+        hash = hash_value(hash, source.height);
+        hash = hash_value(hash, key.size);
+        hash = hash_value(hash, key.padding);
+        hash = hash_value(hash, key.radius);
+        hash = hash_value(hash, options.linear);
+        hash = hash_value(hash, options.compression);
+        hash = hash_value(hash, use_dib_entry(options, key.size));
+        // A cascaded entry is resized from the larger sizes of the same source, so it depends on all of them.
+        hash = hash_value(hash, options.cascade);
+        if(options.cascade)
+        {
+            for(auto& other: plan.keys)
+            {
+                if(other.source == key.source && other.size > key.size) hash = hash_value(hash, other.size);
+            }
+        }
+        update.fingerprints[i] = hash;
+    }
+
+    // Read the existing fingerprints and check they describe the .ico that is there now.
+    std::error_code error;
+    std::string update_file_name = get_ico_update_file_name(options);
+    if(!std::filesystem::is_regular_file(update_file_name, error) || !std::filesystem::is_regular_file(options.output, error))
+    {
+        return;
+    }
+    std::vector<u8> fingerprints = read_entire_binary_file(update_file_name);
+    std::vector<u8> ico = read_entire_binary_file(options.output);
+    u32 header[3] = {};
+    u64 ico_hash = 0;
+    if(fingerprints.size() < sizeof(header) + sizeof(ico_hash))
+    {
+        return;
+    }
+    memcpy(header, fingerprints.data(), sizeof(header));
+    memcpy(&ico_hash, fingerprints.data() + sizeof(header), sizeof(ico_hash));
+    const u8* old_fingerprints = fingerprints.data() + sizeof(header) + sizeof(ico_hash);
+    if(header[0] != ICO_UPDATE_MAGIC || header[1] != ICO_UPDATE_VERSION || ico_hash != hash_bytes(ico.data(), ico.size()) ||
+       fingerprints.size() != sizeof(header) + sizeof(ico_hash) + CAST(size_t, header[2]) * sizeof(u64))
+    {
+        return;
+    }
+
+    IconDir icon_header;
+    if(ico.size() < sizeof(IconDir))
+    {
+        return;
+    }
+    memcpy(&icon_header, ico.data(), sizeof(icon_header));
+    if(icon_header.type != ImageType_Ico || icon_header.num_images != header[2] || ico.size() < sizeof(IconDir) + sizeof(IconDirEntry) * icon_header.num_images)
+    {
+        return;
+    }
+
+    for(u32 j=0; j<header[2]; ++j)
+    {
+        u64 fingerprint;
+        IconDirEntry entry;
+        memcpy(&fingerprint, old_fingerprints + j * sizeof(u64), sizeof(fingerprint));
+        memcpy(&entry, ico.data() + sizeof(IconDir) + j * sizeof(IconDirEntry), sizeof(entry));
+        if(CAST(size_t, entry.offset) + entry.size > ico.size())
+        {
+            continue;
+        }
+        for(size_t i=0; i<count; ++i)
+        {
+            if(update.blobs[i].empty() && update.fingerprints[i] == fingerprint)
+            {
+                update.blobs[i].assign(ico.data() + entry.offset, ico.data() + entry.offset + entry.size);
+            }
+        }
+    }
+}
+
+static void save_ico_update(const Options& options, const IcoUpdate& update, Context& context)
 {
-    std::vector<PngImage> output_images;
+    std::vector<u8> ico = read_entire_binary_file(options.output);
+    u32 header[3] = { ICO_UPDATE_MAGIC, ICO_UPDATE_VERSION, CAST(u32, update.fingerprints.size()) };
+    u64 ico_hash = hash_bytes(ico.data(), ico.size());
+
+    std::vector<u8> data;
+    data.insert(data.end(), CAST(const u8*, header), CAST(const u8*, header) + sizeof(header));
+    data.insert(data.end(), CAST(const u8*, &ico_hash), CAST(const u8*, &ico_hash) + sizeof(ico_hash));
+    data.insert(data.end(), CAST(const u8*, update.fingerprints.data()), CAST(const u8*, update.fingerprints.data()) + update.fingerprints.size() * sizeof(u64));
 
-    for (auto size : options.sizes)
+    std::string file_name = get_ico_update_file_name(options);
+    if(!write_output_file(context.writer, file_name, data.data(), data.size()))
     {
-        // find image of matching size
-        auto it = std::find_if(input_images.begin(), input_images.end(), [=](const Image& image) { return image.width == size && image.height == size; });
+        FAIL(MakeIconError_WriteFailed, "Failed to save output file: %s", file_name.c_str());
+    }
+}
+
+static constexpr s32 ICO_AUTO_PNG_SIZE = 64; // With -ico-format:auto, entries of this size and up are stored as PNG.
+
+static bool use_dib_entry(const Options& options, s32 size)
+{
+    if(options.ico_format == IcoFormat_Auto) return (size < ICO_AUTO_PNG_SIZE);
+    return (options.ico_format == IcoFormat_Bmp);
+}
+
+// Encodes 8-bit RGBA pixels as an uncompressed 32-bit DIB entry: the header, the BGRA colours bottom-up and then a
+// 1-bit AND mask marking the fully transparent pixels. Returns a malloc'd buffer or NULL on failure.
+static u8* encode_dib(const Image& image, size_t* out_size)
+{
+    TraceScope scope("encode");
+    scope.event.size = image.width;
+    scope.event.pixels = CAST(u64, image.width) * image.height;
+    scope.event.bytes_in = scope.event.pixels * 4;
 
-        if (it != input_images.end())
+    size_t color_size = CAST(size_t, image.width) * image.height * 4;
+    size_t mask_stride = ((image.width + 31) / 32) * 4; // Mask rows are padded to 32 bits.
+    size_t mask_size = mask_stride * image.height;
+    size_t size = sizeof(BitmapInfoHeader) + color_size + mask_size;
+    u8* dib = CAST(u8*, calloc(1, size));
+    if(!dib) return NULL;
+
+    BitmapInfoHeader header = {};
+    header.size = sizeof(BitmapInfoHeader);
+    header.width = image.width;
+    header.height = image.height * 2;
+    header.planes = 1;
+    header.bit_count = 32;
+    header.size_image = CAST(u32, color_size + mask_size);
+    memcpy(dib, &header, sizeof(header));
+
+    u8* color = dib + sizeof(BitmapInfoHeader);
+    u8* mask = color + color_size;
+    for(s32 y=0; y<image.height; ++y)
+    {
+        const u8* src = image.data + CAST(size_t, image.height - 1 - y) * image.width * 4;
+        u8* dst = color + CAST(size_t, y) * image.width * 4;
+        u8* mask_row = mask + y * mask_stride;
+        for(s32 x=0; x<image.width; ++x, src+=4, dst+=4)
         {
-            output_images.push_back(PngImage(*it));
+            dst[0] = src[2];
+            dst[1] = src[1];
+            dst[2] = src[0];
+            dst[3] = src[3];
+            if(src[3] == 0) mask_row[x >> 3] |= CAST(u8, 0x80 >> (x & 7));
         }
-        else
+    }
+
+    *out_size = size;
+    scope.event.bytes_out = size;
+    return dib;
+}
+
+s32 make_icon_win32(const Options& options, const std::vector<Image>& input_images, const IcoUpdate* update, Context& context)
+{
+    // The file is streamed to a temporary: space is reserved for the header and directory, each entry's data is
+    // written as soon as it is encoded, and the directory is filled in at the end. The directory keeps the requested
+    // order but the data of the entries doesn't have to, so it is written in the order the entries are encoded:
+    // smallest first, or largest first when cascading as each size is then made from the one above it. The order
+    // is fixed so the output is identical from run to run, an entry that finishes early is held on to until the
+    // ones scheduled before it are written. As those are the cheaper ones this is rarely more than the encodes in
+    // flight, the price is that the data no longer follows the directory order. When the output is only wanted in
+    // memory it is streamed to a buffer instead.
+    RenderPlan plan;
+    plan_renders(options, input_images, options.sizes, true, plan);
+
+    std::string temp_name;
+    std::ofstream file_stream;
+    std::stringstream memory_stream;
+    if(!context.writer.memory)
+    {
+        temp_name = options.output + ".tmp" + std::to_string(std::random_device()());
+        file_stream.open(temp_name, std::ios::binary|std::ios::trunc);
+        if(!file_stream.is_open())
         {
-            // did not find matching input image, so we have to create it
-            Image resized;
-            resize_image(input_images.back(), size, size, resized);
-            output_images.push_back(PngImage(resized));
-            free_image(resized);
+            FAIL(MakeIconError_WriteFailed, "Failed to save output file: %s", options.output.c_str());
         }
     }
+    std::ostream& file = (context.writer.memory) ? CAST(std::ostream&, memory_stream) : file_stream;
 
     // Header
     IconDir icon_header;
@@ -668,46 +5895,133 @@ s32 make_icon_win32(const Options& options, const std::vector<Image>& input_imag
     icon_header.type = ImageType_Ico;
     icon_header.num_images = CAST(u16, options.sizes.size());
 
-    // Directory
-    size_t offset = sizeof(IconDir) + (sizeof(IconDirEntry) * options.sizes.size());
-    std::vector<IconDirEntry> icon_directory;
-    for(const auto& image: output_images)
+    // Directory, filled in as the entries are written.
+    std::vector<IconDirEntry> icon_directory(options.sizes.size());
+    file.write(CAST(const char*, &icon_header), sizeof(icon_header));
+    file.write(CAST(const char*, icon_directory.data()), sizeof(IconDirEntry) * icon_directory.size());
+    size_t offset = sizeof(IconDir) + (sizeof(IconDirEntry) * icon_directory.size());
+
+    // An encoded key can be used by more than one entry if the same size was requested twice. Entries that are
+    // copied from the existing file in an update don't need their key at all.
+    auto reused = [&](size_t i) { return (update && !update->blobs[i].empty()); };
+    std::vector<s32> references(plan.keys.size(), 0);
+    for(size_t i=0; i<plan.outputs.size(); ++i)
     {
-        IconDirEntry icon_dir_entry;
-        icon_dir_entry.width = CAST(u8, image.width); // Values of 256 (the max) will turn into 0 on cast, which is what the ICO spec wants.
-        icon_dir_entry.height = CAST(u8, image.height);
-        icon_dir_entry.num_colors = 0;
-        icon_dir_entry.reserved = 0;
-        icon_dir_entry.color_planes = 0;
-        icon_dir_entry.bpp = 4*8; // We force to 4-channel RGBA!
-        icon_dir_entry.size = CAST(u32, image.data_size);
-        icon_dir_entry.offset = CAST(u32, offset);
-        icon_directory.push_back(icon_dir_entry);
-        offset += icon_dir_entry.size;
+        if(!reused(i)) references[plan.outputs[i]]++;
     }
+    // Both the keys and the entries are put in the order the data is written in, so the encodes are queued in it too.
+    auto scheduled_before = [&](s32 a, s32 b) { return (options.cascade) ? (a > b) : (a < b); };
+    std::vector<size_t> key_order(plan.keys.size());
+    std::vector<size_t> entry_order(plan.outputs.size());
+    for(size_t k=0; k<key_order.size(); ++k) key_order[k] = k;
+    for(size_t i=0; i<entry_order.size(); ++i) entry_order[i] = i;
+    std::stable_sort(key_order.begin(), key_order.end(), [&](size_t a, size_t b) { return scheduled_before(plan.keys[a].size, plan.keys[b].size); });
+    std::stable_sort(entry_order.begin(), entry_order.end(), [&](size_t a, size_t b) { return scheduled_before(options.sizes[a], options.sizes[b]); });
 
-    // Save
-    std::ofstream output(options.output, std::ios::binary|std::ios::trunc);
-    if(!output.is_open())
+    std::vector<RenderKey> render_list;
+    std::vector<size_t> render_index;
+    for(auto k: key_order)
     {
-        ERROR("Failed to save output file: %s", options.output.c_str());
+        if(references[k] == 0) continue;
+        render_list.push_back(plan.keys[k]);
+        render_index.push_back(k);
     }
-    else
+
+    std::mutex mutex;
+    std::vector<PngImage> encoded(plan.keys.size());
+    std::vector<bool> ready(plan.keys.size(), false);
+    size_t next_entry = 0;
+    // Writes out every entry that is next in line and ready, must be called with the mutex held.
+    auto flush_entries = [&]()
+    {
+        while(next_entry < entry_order.size() && (reused(entry_order[next_entry]) || ready[plan.outputs[entry_order[next_entry]]]))
+        {
+            // A reused entry was stored in the same format as it would be now, as that is part of its fingerprint.
+            size_t entry = entry_order[next_entry];
+            size_t key = plan.outputs[entry];
+            s32 size = options.sizes[entry];
+            const u8* data = (reused(entry)) ? update->blobs[entry].data() : encoded[key].data;
+            size_t data_size = (reused(entry)) ? update->blobs[entry].size() : encoded[key].data_size;
+            IconDirEntry& icon_dir_entry = icon_directory[entry];
+            icon_dir_entry.width = CAST(u8, size); // Values of 256 (the max) will turn into 0 on cast, which is what the ICO spec wants.
+            icon_dir_entry.height = CAST(u8, size);
+            icon_dir_entry.num_colors = 0;
+            icon_dir_entry.reserved = 0;
+            icon_dir_entry.color_planes = (use_dib_entry(options, size)) ? 1 : 0;
+            icon_dir_entry.bpp = 4*8; // We force to 4-channel RGBA!
+            icon_dir_entry.size = CAST(u32, data_size);
+            icon_dir_entry.offset = CAST(u32, offset);
+            file.write(CAST(const char*, data), data_size);
+            offset += data_size;
+            if(!reused(entry) && --references[key] == 0)
+            {
+                free_png_image(encoded[key]);
+            }
+            ++next_entry;
+        }
+    };
+    // Each entry is either a PNG or a DIB, both are held as a PngImage as only the encoded bytes are needed.
+    auto encode_entry = [&](const Image& image)
+    {
+        PngImage png;
+        if(use_dib_entry(options, image.width))
+        {
+            png.width = image.width;
+            png.height = image.height;
+            png.data = encode_dib(image, &png.data_size);
+        }
+        else
+        {
+            png = PngImage(image, options.compression);
+        }
+        return png;
+    };
+    auto write_entry = [&](size_t k, PngImage& png)
     {
-        output.write((CAST(char*, &icon_header)), sizeof(icon_header));
-        for(auto& dir_entry: icon_directory)
+        std::lock_guard<std::mutex> lock(mutex);
+        encoded[k] = png;
+        ready[k] = true;
+        flush_entries();
+    };
+    try
+    {
+        encode_shared_keys(options, input_images, render_list, options.ico_format, context, encode_entry, [&](size_t r, PngImage& png) { write_entry(render_index[r], png); });
+        flush_entries(); // Only reused entries can be left, if nothing needed rendering they are all still to go.
+    }
+    catch(...)
+    {
+        for(auto& png: encoded)
         {
-            output.write((CAST(char*, &dir_entry)), sizeof(dir_entry));
+            free_png_image(png);
         }
-        for(const auto& image: output_images)
+        if(!temp_name.empty())
         {
-            output.write(CAST(char*, image.data), image.data_size);
+            std::error_code error;
+            file_stream.close();
+            std::filesystem::remove(temp_name, error);
         }
+        throw;
     }
 
-    for (auto& image : output_images)
+    // Save
+    file.seekp(sizeof(IconDir));
+    file.write(CAST(const char*, icon_directory.data()), sizeof(IconDirEntry) * icon_directory.size());
+    if(context.writer.memory)
+    {
+        std::string data = memory_stream.str();
+        write_output_file(context.writer, options.output, CAST(const u8*, data.data()), data.size());
+        return EXIT_SUCCESS;
+    }
+    file_stream.close();
+    if(!file_stream.good() || !commit_output_file(context.writer, temp_name, options.output))
     {
-        free_png_image(image);
+        std::error_code error;
+        std::filesystem::remove(temp_name, error);
+        FAIL(MakeIconError_WriteFailed, "Failed to save output file: %s", options.output.c_str());
+    }
+    if(update)
+    {
+        save_ico_update(options, *update, context);
     }
 
     return EXIT_SUCCESS;
@@ -717,7 +6031,7 @@ s32 make_icon_win32(const Options& options, const std::vector<Image>& input_imag
 // Android
 //
 
-s32 make_icon_android(const Options& options, const std::vector<Image>& input_images)
+static void get_android_render_jobs(const Options& options, std::vector<RenderJob>& jobs)
 {
     // Android needs specific downsampled sizes for thumbnails.
 
@@ -737,23 +6051,39 @@ s32 make_icon_android(const Options& options, const std::vector<Image>& input_im
         "mipmap-mdpi/"
     };
 
-    // Create output directory.
-    std::filesystem::path output_directory = options.output;
-    if(!std::filesystem::exists(output_directory))
+    for(s32 i=0; i<5; ++i)
     {
-        std::filesystem::create_directory(output_directory);
+        RenderJob job;
+        job.filename = options.output + "/" + directories[i] + "ic_launcher.png";
+        job.size = sizes[i];
+        jobs.push_back(job);
     }
+}
 
-    for(s32 i=0; i<5; ++i)
+s32 make_icon_android(const Options& options, const std::vector<RenderJob>& jobs, const std::vector<Image>& input_images, Context& context)
+{
+    if(!context.writer.memory)
     {
-        std::filesystem::path directory = options.output + "/" + directories[i];
-        if(!std::filesystem::exists(directory))
+        // Create output directory.
+        std::filesystem::path output_directory = options.output;
+        if(!std::filesystem::exists(output_directory))
+        {
+            std::filesystem::create_directory(output_directory);
+        }
+
+        // Create all of the density directories up front so the jobs only have to write files.
+        for(auto& job: jobs)
         {
-            std::filesystem::create_directory(directory);
+            std::filesystem::path directory = std::filesystem::path(job.filename).parent_path();
+            if(!std::filesystem::exists(directory))
+            {
+                std::filesystem::create_directory(directory);
+            }
         }
-        resize_and_save_image(directory.string() + "ic_launcher.png", input_images, sizes[i], options.resize);
     }
 
+    run_render_jobs(options, jobs, input_images, context);
+
     return EXIT_SUCCESS;
 }
 
@@ -761,90 +6091,529 @@ s32 make_icon_android(const Options& options, const std::vector<Image>& input_im
 // Apple
 //
 
-s32 make_icon_apple(const Options& options, const std::vector<Image>& input_images)
+#if !defined(MAKEICON_NO_MAIN) || defined(MAKEICON_BENCH)
+// Reads in the JSON contents file that specifies the required output images.
+static void read_apple_contents(const Options& options, std::string& contents)
 {
     if(options.contents.empty())
     {
-        ERROR("No contents json file specified! Specify contents file using: -sizes:Contents.json...");
+        FAIL(MakeIconError_InvalidInput, "No contents json file specified! Specify contents file using: -sizes:Contents.json...");
+    }
+    std::ifstream file(options.contents, std::ios::binary);
+    if(!file.is_open())
+    {
+        FAIL(MakeIconError_InvalidInput, "Failed to open contents file!");
     }
+    contents.resize(std::filesystem::file_size(options.contents));
+    file.read(&contents[0], contents.size());
+}
+#endif
+
+// A minimal JSON tokenizer that walks the raw contents buffer in a single pass. Strings are returned as ranges of
+// the buffer and are only copied out for the few values that are actually used.
+typedef s32 JsonToken;
+enum JsonToken_
+{
+    JsonToken_End,
+    JsonToken_ObjectBegin,
+    JsonToken_ObjectEnd,
+    JsonToken_ArrayBegin,
+    JsonToken_ArrayEnd,
+    JsonToken_Colon,
+    JsonToken_Comma,
+    JsonToken_String,
+    JsonToken_Number,
+    JsonToken_Literal, // true, false or null.
+    JsonToken_COUNT
+};
 
-    // Read in JSON contents file that specifies the required output images.
-    FILE* file = fopen(options.contents.c_str(), "rb");
-    if(!file) ERROR("Failed to open contents file!");
+struct JsonLexer
+{
+    const char* pos   = NULL;
+    const char* end   = NULL;
+    const char* text  = NULL; // The contents of the current string, number or literal token.
+    size_t      size  = 0;
+    JsonToken   token = JsonToken_End;
+    s32         line  = 1;
+};
 
-    fseek(file, 0L, SEEK_END);
-    size_t len = CAST(size_t,ftell(file));
+#define JSON_FAIL(lexer, what) FAIL(MakeIconError_InvalidInput, "Invalid contents json at line %d: %s", (lexer).line, what)
 
-    fseek(file, 0L, SEEK_SET);
+static JsonToken next_json_token(JsonLexer& lexer)
+{
+    while(lexer.pos < lexer.end && (*lexer.pos == ' ' || *lexer.pos == '\t' || *lexer.pos == '\r' || *lexer.pos == '\n'))
+    {
+        if(*lexer.pos == '\n') lexer.line++;
+        lexer.pos++;
+    }
+    if(lexer.pos >= lexer.end)
+    {
+        return (lexer.token = JsonToken_End);
+    }
 
-    char* buf = CAST(char*, malloc((len+1)*sizeof(char)));
-    if(!buf) ERROR("Failed to allocate file buffer for JSON!");
+    char c = *lexer.pos;
+    switch(c)
+    {
+        case '{': lexer.pos++; return (lexer.token = JsonToken_ObjectBegin);
+        case '}': lexer.pos++; return (lexer.token = JsonToken_ObjectEnd);
+        case '[': lexer.pos++; return (lexer.token = JsonToken_ArrayBegin);
+        case ']': lexer.pos++; return (lexer.token = JsonToken_ArrayEnd);
+        case ':': lexer.pos++; return (lexer.token = JsonToken_Colon);
+        case ',': lexer.pos++; return (lexer.token = JsonToken_Comma);
+    }
 
-    buf[len] = '\0';
+    if(c == '"')
+    {
+        lexer.text = ++lexer.pos;
+        while(lexer.pos < lexer.end && *lexer.pos != '"')
+        {
+            if(*lexer.pos == '\n') JSON_FAIL(lexer, "unterminated string");
+            if(*lexer.pos == '\\') lexer.pos++; // Escapes are resolved when the string is read.
+            lexer.pos++;
+        }
+        if(lexer.pos >= lexer.end) JSON_FAIL(lexer, "unterminated string");
+        lexer.size = CAST(size_t, lexer.pos - lexer.text);
+        lexer.pos++;
+        return (lexer.token = JsonToken_String);
+    }
 
-    fread(buf, 1, len, file);
+    bool number = (c == '-' || (c >= '0' && c <= '9'));
+    bool literal = (c >= 'a' && c <= 'z');
+    if(!number && !literal)
+    {
+        JSON_FAIL(lexer, "unexpected character");
+    }
+    lexer.text = lexer.pos;
+    while(lexer.pos < lexer.end && (isalnum(CAST(u8, *lexer.pos)) || *lexer.pos == '-' || *lexer.pos == '+' || *lexer.pos == '.'))
+    {
+        lexer.pos++;
+    }
+    lexer.size = CAST(size_t, lexer.pos - lexer.text);
+    if(literal)
+    {
+        std::string word(lexer.text, lexer.size);
+        if(word != "true" && word != "false" && word != "null") JSON_FAIL(lexer, "unexpected literal");
+    }
+    return (lexer.token = (number) ? JsonToken_Number : JsonToken_Literal);
+}
 
-    fclose(file);
+static void expect_json_token(JsonLexer& lexer, JsonToken token, const char* what)
+{
+    if(next_json_token(lexer) != token) JSON_FAIL(lexer, what);
+}
 
-    std::stringstream ss(buf);
-    std::string to;
+static bool json_string_equals(const JsonLexer& lexer, const char* str)
+{
+    return (lexer.token == JsonToken_String && lexer.size == strlen(str) && memcmp(lexer.text, str, lexer.size) == 0);
+}
 
-    // Create output directory.
-    std::filesystem::path output_directory = options.output;
-    if(!std::filesystem::exists(output_directory))
+// Copies out the current string token with its escapes resolved.
+static std::string read_json_string(const JsonLexer& lexer)
+{
+    std::string str;
+    str.reserve(lexer.size);
+    for(size_t i=0; i<lexer.size; ++i)
     {
-        std::filesystem::create_directory(output_directory);
+        char c = lexer.text[i];
+        if(c != '\\' || i+1 >= lexer.size)
+        {
+            str += c;
+            continue;
+        }
+        c = lexer.text[++i];
+        switch(c)
+        {
+            case 'b': str += '\b'; break;
+            case 'f': str += '\f'; break;
+            case 'n': str += '\n'; break;
+            case 'r': str += '\r'; break;
+            case 't': str += '\t'; break;
+            case 'u':
+            {
+                if(i+4 >= lexer.size) JSON_FAIL(lexer, "bad unicode escape");
+                u32 code = CAST(u32, strtoul(std::string(lexer.text+i+1, 4).c_str(), NULL, 16));
+                i += 4;
+                // Encode as UTF-8, surrogate pairs are not expected in file names and are kept as separate halves.
+                if(code < 0x80)
+                {
+                    str += CAST(char, code);
+                }
+                else if(code < 0x800)
+                {
+                    str += CAST(char, 0xC0|(code>>6));
+                    str += CAST(char, 0x80|(code&0x3F));
+                }
+                else
+                {
+                    str += CAST(char, 0xE0|(code>>12));
+                    str += CAST(char, 0x80|((code>>6)&0x3F));
+                    str += CAST(char, 0x80|(code&0x3F));
+                }
+            } break;
+            default: str += c; break; // Covers \" \\ and \/.
+        }
     }
+    return str;
+}
 
-    // Iterate over the lines of json and find parameters for resizing and saving the images.
-    std::string filename = "";
-    f32 scale = 0;
+// Moves on to the next member of an object or element of an array, returns false once the closing token is reached.
+// Every member after the first has to follow a comma and a comma can't come right before the closing token.
+static bool next_json_member(JsonLexer& lexer, JsonToken close, bool& first)
+{
+    next_json_token(lexer);
+    if(first)
+    {
+        first = false;
+        return (lexer.token != close);
+    }
+    if(lexer.token == close)
+    {
+        return false;
+    }
+    if(lexer.token != JsonToken_Comma) JSON_FAIL(lexer, (close == JsonToken_ObjectEnd) ? "expected ',' or '}'" : "expected ',' or ']'");
+    if(next_json_token(lexer) == close) JSON_FAIL(lexer, "trailing comma");
+    return true;
+}
+
+// Skips over the value that starts with the current token, including everything nested inside of it.
+static void skip_json_value(JsonLexer& lexer, s32 depth = 0)
+{
+    if(depth > 64) JSON_FAIL(lexer, "values nested too deeply");
+    bool first = true;
+    switch(lexer.token)
+    {
+        case JsonToken_String: case JsonToken_Number: case JsonToken_Literal: break;
+        case JsonToken_ObjectBegin:
+        {
+            while(next_json_member(lexer, JsonToken_ObjectEnd, first))
+            {
+                if(lexer.token != JsonToken_String) JSON_FAIL(lexer, "expected a key");
+                expect_json_token(lexer, JsonToken_Colon, "expected ':'");
+                next_json_token(lexer);
+                skip_json_value(lexer, depth+1);
+            }
+        } break;
+        case JsonToken_ArrayBegin:
+        {
+            while(next_json_member(lexer, JsonToken_ArrayEnd, first))
+            {
+                skip_json_value(lexer, depth+1);
+            }
+        } break;
+        case JsonToken_End: JSON_FAIL(lexer, "unexpected end of file");
+        default: JSON_FAIL(lexer, "expected a value");
+    }
+}
+
+// Parses a "16x16" size or "2x" scale string, only the leading number matters as apple icons are always square.
+static f32 parse_apple_dimension(const JsonLexer& lexer)
+{
+    if(lexer.token != JsonToken_String) JSON_FAIL(lexer, "expected a string for size or scale");
+    std::string str = read_json_string(lexer);
+    char* end = NULL;
+    f32 value = strtof(str.c_str(), &end);
+    if(end == str.c_str() || *end != 'x' || value <= 0.0f)
+    {
+        JSON_FAIL(lexer, ("invalid size or scale \"" + str + "\"").c_str());
+    }
+    return value;
+}
+
+// ICNS File Format: https://en.wikipedia.org/wiki/Apple_Icon_Image_format
+
+// The element types that hold PNG data, by the point size and scale of the image stored in them.
+struct IcnsElementType
+{
+    const char* type;
+    s32         size;
+    s32         scale;
+};
+
+static constexpr IcnsElementType ICNS_ELEMENT_TYPES[] =
+{
+    { "icp4",  16, 1 }, { "ic11",  16, 2 },
+    { "icp5",  32, 1 }, { "ic12",  32, 2 },
+    { "ic07", 128, 1 }, { "ic13", 128, 2 },
+    { "ic08", 256, 1 }, { "ic14", 256, 2 },
+    { "ic09", 512, 1 }, { "ic10", 512, 2 }
+};
+
+#pragma pack(push,1)
+struct IcnsElementHeader
+{
+    char type[4];
+    u8   size[4]; // Big-endian, includes the header itself.
+};
+#pragma pack(pop)
+
+static bool is_icns_output(const Options& options)
+{
+    return (options.platform == Platform_OSX && std::filesystem::path(options.output).extension() == ".icns");
+}
+
+static const char* find_icns_element(s32 size, s32 scale)
+{
+    for(auto& element: ICNS_ELEMENT_TYPES)
+    {
+        if(element.size == size && element.scale == scale) return element.type;
+    }
+    return NULL;
+}
+
+// Without a contents json every requested pixel size fills all of the element types that hold that size, and if no
+// sizes were requested then every element type is filled.
+static void get_icns_render_jobs(const Options& options, std::vector<RenderJob>& jobs)
+{
+    for(auto& element: ICNS_ELEMENT_TYPES)
+    {
+        s32 size = element.size * element.scale;
+        if(options.sizes.empty() || std::find(options.sizes.begin(), options.sizes.end(), size) != options.sizes.end())
+        {
+            RenderJob job;
+            job.filename = options.output;
+            job.size = size;
+            job.element = element.type;
+            jobs.push_back(job);
+        }
+    }
+    for(auto size: options.sizes)
+    {
+        bool found = false;
+        for(auto& job: jobs)
+        {
+            found = found || (job.size == size);
+        }
+        if(!found)
+            FAIL(MakeIconError_InvalidArgument, "Invalid icon size '%d'! An .icns file can only hold sizes 16, 32, 64, 128, 256, 512 and 1024.", size);
+    }
+}
+
+// Parses one entry of the images array into a render job, returns false for entries without a file name (Xcode
+// lists every slot of an icon set even when no image has been assigned to it).
+static bool parse_apple_image(const Options& options, JsonLexer& lexer, RenderJob& job)
+{
+    if(lexer.token != JsonToken_ObjectBegin) JSON_FAIL(lexer, "expected an object in images");
+
+    std::string filename;
     f32 size = 0;
-    while(getline(ss, to, '\n'))
+    f32 scale = 0;
+    s32 line = lexer.line;
+    bool first = true;
+    while(next_json_member(lexer, JsonToken_ObjectEnd, first))
     {
-        s32 start = CAST(s32, to.find(": \"") + 3);
+        if(lexer.token != JsonToken_String) JSON_FAIL(lexer, "expected a key");
+        std::string key(lexer.text, lexer.size);
+        expect_json_token(lexer, JsonToken_Colon, "expected ':'");
+        next_json_token(lexer);
 
-        if(to.find("filename") != -1)
+        if(key == "filename")
+        {
+            if(lexer.token != JsonToken_String) JSON_FAIL(lexer, "expected a string for filename");
+            filename = read_json_string(lexer);
+        }
+        else if(key == "idiom" && lexer.token == JsonToken_String)
+        {
+            job.idiom = read_json_string(lexer);
+        }
+        else if(key == "size")
+        {
+            size = parse_apple_dimension(lexer);
+        }
+        else if(key == "scale")
         {
-            s32 end = CAST(s32, to.find("\","));
-            filename = to.substr(start, (end - start));
+            scale = parse_apple_dimension(lexer);
         }
-        else if(to.find("scale") != -1)
+        else
         {
-            s32 end = CAST(s32, to.find("x"));
-            scale = std::stof(to.substr(start, (end - start)));
+            skip_json_value(lexer);
         }
-        else if(to.find("size") != -1)
+    }
+
+    if(filename.empty())
+    {
+        return false;
+    }
+    if(!size || !scale)
+    {
+        WARNING("Image '%s' in contents json at line %d has no size or scale and will be skipped!", filename.c_str(), line);
+        return false;
+    }
+    job.filename = options.output + "/" + filename;
+    job.size = CAST(s32, size * scale);
+    if(is_icns_output(options))
+    {
+        // Only the entries that have a slot in the .icns file are kept, like iconutil does.
+        job.element = find_icns_element(CAST(s32, size), CAST(s32, scale));
+        if(!job.element)
         {
-            s32 end = CAST(s32, to.find("x"));
-            size = std::stof(to.substr(start, (end - start)));
+            WARNING("Image '%s' in contents json at line %d has no .icns element type and will be skipped!", filename.c_str(), line);
+            return false;
         }
+    }
+    return true;
+}
+
+// Turns every entry of the images array into a render job. The images are only gathered into a job list here,
+// they are all planned and rendered together once the inputs are loaded. Keys can come in any order and with any
+// formatting, unknown keys and values are skipped.
+static void get_apple_render_jobs(const Options& options, const std::string& contents, std::vector<RenderJob>& jobs)
+{
+    JsonLexer lexer;
+    lexer.pos = contents.data();
+    lexer.end = contents.data() + contents.size();
+
+    // Skip a UTF-8 byte order mark if the file has one.
+    if(contents.size() >= 3 && memcmp(lexer.pos, "\xEF\xBB\xBF", 3) == 0)
+    {
+        lexer.pos += 3;
+    }
 
-        // Erase all stored parameters on hitting the end of the json object.
-        if(to.find('}') != -1)
+    expect_json_token(lexer, JsonToken_ObjectBegin, "expected an object");
+    bool first_key = true;
+    while(next_json_member(lexer, JsonToken_ObjectEnd, first_key))
+    {
+        if(lexer.token != JsonToken_String) JSON_FAIL(lexer, "expected a key");
+        bool images = json_string_equals(lexer, "images");
+        expect_json_token(lexer, JsonToken_Colon, "expected ':'");
+        next_json_token(lexer);
+        if(!images)
         {
-            filename = "";
-            size = 0;
-            scale = 0;
+            skip_json_value(lexer);
+            continue;
         }
 
-        // Once all parameters are filled write out an image and reset.
-        if(!filename.empty() && scale && size)
+        if(lexer.token != JsonToken_ArrayBegin) JSON_FAIL(lexer, "expected an array for images");
+        bool first_image = true;
+        while(next_json_member(lexer, JsonToken_ArrayEnd, first_image))
         {
-            resize_and_save_image(options.output + "/" + filename, input_images, CAST(s32, size * scale), options.resize);
+            RenderJob job;
+            if(parse_apple_image(options, lexer, job))
+            {
+                jobs.push_back(job);
+            }
+        }
+    }
+    if(next_json_token(lexer) != JsonToken_End)
+    {
+        JSON_FAIL(lexer, "unexpected data after the end of the file");
+    }
+}
+
+#undef JSON_FAIL
+
+// Packs the encoded PNGs straight into an .icns file, with a table of contents up front listing every element.
+static s32 make_icon_icns(const Options& options, const std::vector<RenderJob>& jobs, const std::vector<Image>& input_images, Context& context)
+{
+    if(jobs.empty())
+    {
+        FAIL(MakeIconError_InvalidInput, "None of the images in the contents json have an .icns element type!");
+    }
+
+    std::vector<s32> sizes;
+    for(auto& job: jobs)
+    {
+        sizes.push_back(job.size);
+    }
+
+    RenderPlan plan;
+    plan_renders(options, input_images, sizes, options.resize, plan);
+
+    std::vector<PngImage> encoded;
+    encode_render_plan(options, input_images, plan, context, encoded);
 
-            filename = "";
-            scale = 0;
-            size = 0;
+    // A contents json can list the same slot twice, only the first one is stored.
+    std::vector<size_t> entries;
+    for(size_t i=0; i<jobs.size(); ++i)
+    {
+        bool duplicate = false;
+        for(auto j: entries)
+        {
+            duplicate = duplicate || (strcmp(jobs[i].element, jobs[j].element) == 0);
         }
+        if(!duplicate) entries.push_back(i);
+    }
+
+    auto make_header = [](const char* type, size_t size)
+    {
+        IcnsElementHeader header;
+        memcpy(header.type, type, sizeof(header.type));
+        u8* out = header.size;
+        png_write_u32(out, CAST(u32, size));
+        return header;
+    };
+
+    size_t toc_size = sizeof(IcnsElementHeader) * (1 + entries.size());
+    size_t file_size = sizeof(IcnsElementHeader) + toc_size;
+    for(auto i: entries)
+    {
+        file_size += sizeof(IcnsElementHeader) + encoded[plan.outputs[i]].data_size;
     }
 
-    free(buf);
+    std::vector<u8> data;
+    data.reserve(file_size);
+    auto write = [&](const void* src, size_t size)
+    {
+        data.insert(data.end(), CAST(const u8*, src), CAST(const u8*, src) + size);
+    };
+
+    // Header and table of contents, which holds the header of each element that follows.
+    IcnsElementHeader header = make_header("icns", file_size);
+    write(&header, sizeof(header));
+    header = make_header("TOC ", toc_size);
+    write(&header, sizeof(header));
+    for(auto i: entries)
+    {
+        header = make_header(jobs[i].element, sizeof(IcnsElementHeader) + encoded[plan.outputs[i]].data_size);
+        write(&header, sizeof(header));
+    }
+
+    // Elements
+    for(auto i: entries)
+    {
+        const PngImage& png = encoded[plan.outputs[i]];
+        header = make_header(jobs[i].element, sizeof(IcnsElementHeader) + png.data_size);
+        write(&header, sizeof(header));
+        write(png.data, png.data_size);
+    }
+
+    for(auto& png: encoded)
+    {
+        free_png_image(png);
+    }
+
+    if(!write_output_file(context.writer, options.output, data.data(), data.size()))
+    {
+        FAIL(MakeIconError_WriteFailed, "Failed to save output file: %s", options.output.c_str());
+    }
+
+    return EXIT_SUCCESS;
+}
+
+s32 make_icon_apple(const Options& options, const std::string& contents, const std::vector<RenderJob>& jobs, const std::vector<Image>& input_images, Context& context)
+{
+    if(is_icns_output(options))
+    {
+        return make_icon_icns(options, jobs, input_images, context);
+    }
+
+    // Create output directory.
+    std::filesystem::path output_directory = options.output;
+    if(!context.writer.memory && !std::filesystem::exists(output_directory))
+    {
+        std::filesystem::create_directory(output_directory);
+    }
+
+    run_render_jobs(options, jobs, input_images, context);
 
     // Copy the contents file to the output directory so all data is packaged together.
     std::string outputContentsPath = options.output + "/Contents.json";
     if(options.contents != outputContentsPath)
-        std::filesystem::copy(options.contents, outputContentsPath);
+    {
+        if(!write_output_file(context.writer, outputContentsPath, CAST(const u8*, contents.data()), contents.size()))
+        {
+            FAIL(MakeIconError_WriteFailed, "Failed to save output file: %s", outputContentsPath.c_str());
+        }
+    }
 
     return EXIT_SUCCESS;
 }
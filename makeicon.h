@@ -0,0 +1,70 @@
+#ifndef MAKEICON_H
+#define MAKEICON_H
+
+// Library interface to makeicon, for generating icons in-process without going through the filesystem. Build
+// makeicon.cpp with MAKEICON_NO_MAIN defined and include this header. The inputs are read from memory and every
+// generated file is handed back in memory, nothing is written to disk. Failures are returned as error codes rather
+// than aborting, and separate calls share no state so they can run concurrently from different threads.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+enum MakeIconError
+{
+    MakeIconError_None,
+    MakeIconError_InvalidArgument, // The request itself is malformed, such as an unknown platform or a bad size.
+    MakeIconError_InvalidInput,    // An input image could not be decoded or the contents json could not be parsed.
+    MakeIconError_MissingSize,     // A size was requested that no input provides and resizing was not allowed.
+    MakeIconError_OutOfMemory,
+    MakeIconError_EncodeFailed,
+    MakeIconError_WriteFailed,
+    MakeIconError_COUNT
+};
+
+// An input image, either an encoded image file (PNG, JPEG, BMP, TGA...) or raw 8-bit RGBA pixels. Raw pixels are
+// given with their width and height and must be tightly packed, for encoded files both are left as zero. The data
+// is only read during the call and must stay valid until it returns.
+struct MakeIconInput
+{
+    const uint8_t* data   = NULL;
+    size_t         size   = 0;
+    int32_t        width  = 0;
+    int32_t        height = 0;
+    std::string    name; // Used to identify the input in error messages.
+};
+
+// The same settings as the command-line options of the same names.
+struct MakeIconRequest
+{
+    std::string                platform    = "win32"; // win32, osx, ios or android.
+    std::vector<int32_t>       sizes;                 // Icon sizes for win32, the largest size for android.
+    std::string                contents;              // The text of the Contents.json for osx and ios.
+    std::string                output;                // The path the generated files are named relative to, or an .icns file on osx.
+    std::vector<MakeIconInput> inputs;
+    bool                       resize      = false;
+    bool                       cascade     = false;
+    bool                       linear      = false;
+    float                      padding     = 0.0f;
+    float                      radius      = 0.0f;
+    int32_t                    jobs        = 0;         // Worker threads for this call, 0 means the number of cores.
+    std::string                compression = "default"; // fast, default or max.
+    std::string                ico_format  = "png";     // png, bmp or auto, how win32 .ico entries are stored.
+};
+
+// A generated file, for win32 this is the .ico and for the other platforms it is every file of the icon set.
+struct MakeIconFile
+{
+    std::string          path;
+    std::vector<uint8_t> data;
+};
+
+// Generates the icon described by the request and appends the files to `files`. On failure nothing is appended,
+// the error code is returned and, if `message` is not NULL, it is set to a description of what went wrong.
+MakeIconError makeicon_generate(const MakeIconRequest& request, std::vector<MakeIconFile>& files, std::string* message = NULL);
+
+const char* makeicon_error_name(MakeIconError error);
+
+#endif // MAKEICON_H
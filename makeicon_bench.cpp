@@ -0,0 +1,662 @@
+// Benchmarks for the makeicon pipeline. The PNG filter kernels are timed against stb at icon sizes, then each stage
+// (decode, modify, resize, encode) and each platform driver is timed on synthetic sources of different kinds and
+// sizes, and the results are written out as JSON. A previous run can be passed in as a baseline, in which case the
+// benchmark fails if any result got slower than allowed.
+//
+// Every benchmark runs in a fresh process of its own, the program starts itself again with -run and the name of
+// the benchmark, so that the peak memory it reports belongs to that benchmark alone. It covers the process, the
+// inputs the benchmark is set up with and the work being timed.
+
+#define MAKEICON_NO_MAIN
+#define MAKEICON_BENCH
+#include "makeicon.cpp"
+
+#include <chrono>
+
+#if defined(_WIN32)
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#define popen _popen
+#define pclose _pclose
+#else
+#include <sys/resource.h>
+#endif
+
+static constexpr const char* MAKEICON_BENCH_HELP_MESSAGE =
+"makeicon_bench [-help] [-sizes:x,y,z...] [-sources:name...] [-iterations:n] [-jobs:n] [-baseline:file] [-threshold:t] [output]\n"
+"\n"
+"    -sizes:...      [Optional]  Comma-separated source sizes to benchmark, defaults to 512,1024,2048,4096,8192.\n"
+"    -sources:...    [Optional]  Comma-separated synthetic sources to use. Options are flat, gradient, noise, alpha. Defaults to all.\n"
+"    -iterations     [Optional]  Number of times each benchmark is run, the fastest run is reported. Defaults to 3.\n"
+"    -jobs           [Optional]  Number of worker threads used by the platform drivers, defaults to the number of cores.\n"
+"    -baseline       [Optional]  JSON results from a previous run to compare against, exits with failure on a regression.\n"
+"    -threshold      [Optional]  How much slower than the baseline a result may be before it counts as a regression, defaults to 0.1 (10%).\n"
+"    -help           [Optional]  Prints out this help/usage message for the program and exits.\n"
+"     output         [Optional]  File to write the JSON results to, defaults to stdout.\n";
+
+typedef s32 BenchSource;
+enum BenchSource_
+{
+    BenchSource_Flat,
+    BenchSource_Gradient,
+    BenchSource_Noise,
+    BenchSource_Alpha,
+    BenchSource_COUNT
+};
+
+static constexpr const char* BENCH_SOURCE_NAMES[BenchSource_COUNT] = { "flat", "gradient", "noise", "alpha" };
+
+struct BenchOptions
+{
+    std::vector<s32>         sizes = { 512, 1024, 2048, 4096, 8192 };
+    std::vector<BenchSource> sources;
+    s32                      iterations = 3;
+    s32                      jobs = 0;
+    std::string              baseline;
+    f64                      threshold = 0.1;
+    std::string              output;
+    std::string              program; // How this program was started, to start it again for each benchmark.
+    std::string              run;     // The one benchmark to run in this process, set in the processes started for them.
+    std::string              work;    // The directory shared with those processes, holding the inputs they read.
+};
+
+struct BenchResult
+{
+    std::string name;
+    f64         seconds     = 0.0;
+    f64         mpix_per_s  = 0.0;
+    f64         peak_rss_mb = 0.0;
+};
+
+static f64 get_peak_rss_mb()
+{
+    #if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if(GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return CAST(f64, counters.PeakWorkingSetSize) / (1024.0 * 1024.0);
+    }
+    return 0.0;
+    #else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    #if defined(__APPLE__)
+    return CAST(f64, usage.ru_maxrss) / (1024.0 * 1024.0); // Bytes on macOS.
+    #else
+    return CAST(f64, usage.ru_maxrss) / 1024.0; // Kilobytes on Linux.
+    #endif
+    #endif
+}
+
+// Generates a square RGBA test image, the noise source is meant to compress and resample like a photograph.
+static Image generate_source(BenchSource source, s32 size)
+{
+    Image image;
+    image.width = size;
+    image.height = size;
+    image.bpp = 4;
+    image.data = CAST(u8*, malloc(CAST(size_t, size) * size * 4));
+    if(!image.data)
+    {
+        ERROR("Failed to allocate memory for %dx%d image!", size, size);
+    }
+
+    std::mt19937 random(CAST(u32, size));
+    for(s32 y=0; y<size; ++y)
+    {
+        u8* pixel = image.data + CAST(size_t, y) * size * 4;
+        for(s32 x=0; x<size; ++x, pixel+=4)
+        {
+            f32 u = CAST(f32, x) / size;
+            f32 v = CAST(f32, y) / size;
+            switch(source)
+            {
+                case BenchSource_Flat:
+                {
+                    pixel[0] = 32; pixel[1] = 128; pixel[2] = 224; pixel[3] = 255;
+                } break;
+                case BenchSource_Gradient:
+                {
+                    pixel[0] = CAST(u8, u * 255.0f);
+                    pixel[1] = CAST(u8, v * 255.0f);
+                    pixel[2] = CAST(u8, (1.0f - u) * 255.0f);
+                    pixel[3] = 255;
+                } break;
+                case BenchSource_Noise:
+                {
+                    // Smooth low frequency shapes with grain on top.
+                    f32 shape = 0.5f + 0.25f * sinf(u * 17.0f + v * 5.0f) + 0.25f * cosf(v * 23.0f - u * 3.0f);
+                    for(s32 c=0; c<3; ++c)
+                    {
+                        s32 value = CAST(s32, shape * (160 + 40 * c)) + CAST(s32, random() % 33) - 16;
+                        pixel[c] = CAST(u8, std::clamp(value, 0, 255));
+                    }
+                    pixel[3] = 255;
+                } break;
+                case BenchSource_Alpha:
+                {
+                    // Soft edged circles on a transparent background.
+                    f32 dx = fmodf(u * 4.0f, 1.0f) - 0.5f;
+                    f32 dy = fmodf(v * 4.0f, 1.0f) - 0.5f;
+                    f32 coverage = std::clamp((0.4f - sqrtf(dx*dx + dy*dy)) * 10.0f, 0.0f, 1.0f);
+                    pixel[0] = CAST(u8, u * 255.0f);
+                    pixel[1] = 200;
+                    pixel[2] = CAST(u8, v * 255.0f);
+                    pixel[3] = CAST(u8, coverage * 255.0f);
+                } break;
+            }
+        }
+    }
+    return image;
+}
+
+static constexpr const char* BENCH_RESULT_FORMAT = "    { \"name\": \"%s\", \"seconds\": %.6f, \"mpix_per_s\": %.4f, \"peak_rss_mb\": %.1f }";
+
+static bool parse_result(const std::string& line, BenchResult& result)
+{
+    char name[256];
+    if(sscanf(line.c_str(), " { \"name\": \"%255[^\"]\", \"seconds\": %lf, \"mpix_per_s\": %lf, \"peak_rss_mb\": %lf",
+        name, &result.seconds, &result.mpix_per_s, &result.peak_rss_mb) != 4)
+    {
+        return false;
+    }
+    result.name = name;
+    return true;
+}
+
+// Runs the function the requested number of times and prints the fastest run, along with the peak memory of the
+// process. This is only called in the process started for the benchmark.
+static void run_bench(const BenchOptions& bench, const std::string& name, f64 megapixels, const std::function<void()>& func)
+{
+    BenchResult result;
+    result.name = name;
+    result.seconds = 1e30;
+    for(s32 i=0; i<bench.iterations; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        auto end = std::chrono::steady_clock::now();
+        result.seconds = std::min(result.seconds, std::chrono::duration<f64>(end - start).count());
+    }
+    result.mpix_per_s = (result.seconds > 0.0) ? megapixels / result.seconds : 0.0;
+    result.peak_rss_mb = get_peak_rss_mb();
+    fprintf(stdout, BENCH_RESULT_FORMAT, result.name.c_str(), result.seconds, result.mpix_per_s, result.peak_rss_mb);
+    fprintf(stdout, "\n");
+}
+
+// Starts a fresh process that runs just the named benchmark and collects its result.
+static void spawn_bench(const BenchOptions& bench, const std::string& name, std::vector<BenchResult>& results)
+{
+    std::string command = "\"" + bench.program + "\" -run:" + name + " -work:\"" + bench.work + "\"" +
+        " -iterations:" + std::to_string(bench.iterations) + " -jobs:" + std::to_string(bench.jobs);
+    FILE* pipe = popen(command.c_str(), "r");
+    if(!pipe)
+    {
+        ERROR("Failed to start benchmark: %s", name.c_str());
+    }
+    BenchResult result;
+    bool found = false;
+    char line[512];
+    while(fgets(line, sizeof(line), pipe))
+    {
+        found = found || parse_result(line, result);
+    }
+    if(pclose(pipe) != 0 || !found || result.name != name)
+    {
+        ERROR("Benchmark failed: %s", name.c_str());
+    }
+    results.push_back(result);
+    fprintf(stderr, "%-32s %10.3f ms %10.2f MPix/s %8.1f MB\n", name.c_str(), result.seconds * 1000.0, result.mpix_per_s, result.peak_rss_mb);
+}
+
+static void png_filter_row_scalar(const u8* row, const u8* prev, s32 size, s32 filter, u8* out)
+{
+    png_filter_span(row, prev, 0, size, filter, out);
+}
+
+// Adaptive filtering the way stb_image_write does it, as the reference the kernels are measured against.
+static void stb_filter_image(const Image& image, u8* filtered)
+{
+    s32 row_size = image.width * 4;
+    std::vector<s8> candidate(row_size);
+    for(s32 y=0; y<image.height; ++y)
+    {
+        u8* dst = filtered + y * (row_size + 1);
+        s32 best_filter = 0;
+        s32 best_score = 0x7fffffff;
+        for(s32 filter=0; filter<5; ++filter)
+        {
+            stbiw__encode_png_line(image.data, row_size, image.width, image.height, y, 4, filter, candidate.data());
+            s32 score = 0;
+            for(s32 i=0; i<row_size; ++i) score += abs(CAST(s32, candidate[i]));
+            if(score < best_score)
+            {
+                best_score = score;
+                best_filter = filter;
+            }
+        }
+        stbiw__encode_png_line(image.data, row_size, image.width, image.height, y, 4, best_filter, CAST(s8*, dst + 1));
+        dst[0] = CAST(u8, best_filter);
+    }
+}
+
+static std::vector<std::pair<const char*, PngFilterKernels>> get_filter_kernels()
+{
+    std::vector<std::pair<const char*, PngFilterKernels>> kernels = { { "scalar", { png_filter_row_scalar, png_row_score_scalar } } };
+    #if defined(MAKEICON_SIMD_X64)
+    kernels.push_back({ "sse2", { png_filter_row_sse2, png_row_score_sse2 } });
+    if(cpu_has_avx2()) kernels.push_back({ "avx2", { png_filter_row_avx2, png_row_score_avx2 } });
+    #endif
+    return kernels;
+}
+
+// Times the adaptive PNG row filter, which tries all five filters on every row and scores each one, with stb's
+// code or with one of our kernels. Every kernel has to produce exactly the same bytes as stb.
+static void run_filter_bench(const BenchOptions& bench, s32 size, const std::string& kernel)
+{
+    // Small sizes are filtered several times per run so that each run takes long enough to time.
+    Image source = generate_source(BenchSource_Noise, size);
+    s32 repeats = std::max(1, (1024 * 1024) / (size * size));
+    f64 megapixels = CAST(f64, size) * size * repeats / 1e6;
+    size_t filtered_size = CAST(size_t, size * 4 + 1) * size;
+    std::vector<u8> expected(filtered_size);
+    std::vector<u8> filtered(filtered_size);
+    stb_filter_image(source, expected.data());
+
+    std::string name = "filter/" + std::to_string(size) + "/" + kernel;
+    if(kernel == "stb")
+    {
+        run_bench(bench, name, megapixels, [&]() { for(s32 i=0; i<repeats; ++i) stb_filter_image(source, filtered.data()); });
+    }
+    for(auto& [kernel_name, kernels]: get_filter_kernels())
+    {
+        if(kernel != kernel_name) continue;
+        run_bench(bench, name, megapixels, [&]()
+        {
+            for(s32 i=0; i<repeats; ++i) png_filter_image(source.data, size, size, size * 4, PNG_FILTER_ADAPTIVE, filtered.data(), kernels);
+        });
+    }
+    if(filtered != expected)
+    {
+        ERROR("The %s filter kernel doesn't match stb at %dx%d!", kernel.c_str(), size, size);
+    }
+    free_image(source);
+}
+
+static void benchmark_filters(const BenchOptions& bench, s32 size, std::vector<BenchResult>& results)
+{
+    std::string prefix = "filter/" + std::to_string(size) + "/";
+    spawn_bench(bench, prefix + "stb", results);
+    f64 stb_seconds = results.back().seconds;
+    for(auto& kernel: get_filter_kernels())
+    {
+        spawn_bench(bench, prefix + kernel.first, results);
+        fprintf(stderr, "%-32s %10.2fx speedup over stb\n", (prefix + kernel.first).c_str(), stb_seconds / results.back().seconds);
+    }
+}
+
+static void write_apple_contents(const std::string& file_name)
+{
+    // The same layout Xcode writes, which is what get_apple_render_jobs expects.
+    static constexpr const char* SIZES[][3] =
+    {
+        { "20",   "2", "iphone" }, { "20", "3", "iphone" }, { "29", "2", "iphone" }, { "29", "3", "iphone" },
+        { "40",   "2", "iphone" }, { "40", "3", "iphone" }, { "60", "2", "iphone" }, { "60", "3", "iphone" },
+        { "20",   "1", "ipad"   }, { "29", "1", "ipad"   }, { "40", "1", "ipad"   }, { "76", "2", "ipad"   },
+        { "83.5", "2", "ipad"   }, { "1024", "1", "ios-marketing" }
+    };
+    std::ofstream file(file_name, std::ios::trunc);
+    file << "{\n  \"images\" : [\n";
+    for(size_t i=0; i<sizeof(SIZES)/sizeof(SIZES[0]); ++i)
+    {
+        file << "    {\n";
+        file << "      \"filename\" : \"icon_" << SIZES[i][0] << "@" << SIZES[i][1] << "x_" << SIZES[i][2] << ".png\",\n";
+        file << "      \"idiom\" : \"" << SIZES[i][2] << "\",\n";
+        file << "      \"scale\" : \"" << SIZES[i][1] << "x\",\n";
+        file << "      \"size\" : \"" << SIZES[i][0] << "x" << SIZES[i][0] << "\"\n";
+        file << "    }" << ((i + 1 < sizeof(SIZES)/sizeof(SIZES[0])) ? "," : "") << "\n";
+    }
+    file << "  ],\n  \"info\" : {\n    \"author\" : \"xcode\",\n    \"version\" : 1\n  }\n}\n";
+}
+
+static constexpr const char* BENCH_STAGES[] = { "decode", "modify", "resize", "encode_fast", "encode_default", "encode_max", "win32", "android", "apple" };
+
+static std::string get_source_file_name(const BenchOptions& bench, BenchSource kind, s32 size, const char* suffix)
+{
+    return (std::filesystem::path(bench.work) / (std::string(BENCH_SOURCE_NAMES[kind]) + "_" + std::to_string(size) + suffix + ".png")).string();
+}
+
+static void write_source_file(const Image& image, const std::string& file_name)
+{
+    s32 png_size = 0;
+    u8* png = encode_png(image.data, image.width, image.height, image.width * 4, Compression_Fast, &png_size);
+    if(!png || !write_entire_binary_file(file_name, png, png_size))
+    {
+        ERROR("Failed to save output file: %s", file_name.c_str());
+    }
+    free(png);
+}
+
+static Image read_source_file(const std::string& file_name)
+{
+    Image image;
+    image.bpp = 4;
+    s32 channels = 0;
+    image.data = stbi_load(file_name.c_str(), &image.width, &image.height, &channels, 4);
+    if(!image.data)
+    {
+        ERROR("Failed to load input image: %s", file_name.c_str());
+    }
+    return image;
+}
+
+// Writes the source as the PNG that the decode benchmark and the drivers read, along with the icon sized copy of
+// it that the encode benchmarks read, so that neither has to generate the source first.
+static void prepare_source(const BenchOptions& bench, BenchSource kind, s32 size)
+{
+    Image source = generate_source(kind, size);
+    write_source_file(source, get_source_file_name(bench, kind, size, ""));
+
+    // Encoding is timed at the largest size an icon would actually be written at.
+    s32 encode_size = std::min(size, 1024);
+    Image encode_source;
+    if(!resize_image(source, encode_size, encode_size, encode_source))
+    {
+        ERROR("Failed to allocate memory for %dx%d image!", encode_size, encode_size);
+    }
+    write_source_file(encode_source, get_source_file_name(bench, kind, size, "_encode"));
+    free_image(encode_source);
+    free_image(source);
+}
+
+// Runs one stage on one source, only what that stage needs is set up.
+static void run_source_bench(const BenchOptions& bench, BenchSource kind, s32 size, const std::string& stage)
+{
+    std::string name = std::string(BENCH_SOURCE_NAMES[kind]) + "/" + std::to_string(size) + "/" + stage;
+    std::string input = get_source_file_name(bench, kind, size, "");
+    f64 megapixels = CAST(f64, size) * size / 1e6;
+
+    if(stage == "decode")
+    {
+        std::vector<u8> png = read_entire_binary_file(input);
+        run_bench(bench, name, megapixels, [&]()
+        {
+            s32 width = 0, height = 0, channels = 0;
+            u8* data = stbi_load_from_memory(png.data(), CAST(s32, png.size()), &width, &height, &channels, 4);
+            stbi_image_free(data);
+        });
+    }
+    else if(stage == "modify" || stage == "resize")
+    {
+        Image source = generate_source(kind, size);
+        s32 output_size = (stage == "modify") ? size : 256;
+        run_bench(bench, name, megapixels, [&]()
+        {
+            Image output;
+            bool rendered = (stage == "modify") ? render_image(source, NULL, size, 0.1f, 0.2f, output) : resize_image(source, 256, 256, output);
+            if(!rendered)
+            {
+                ERROR("Failed to allocate memory for %dx%d image!", output_size, output_size);
+            }
+            free_image(output);
+        });
+        free_image(source);
+    }
+    else if(stage.compare(0, 7, "encode_") == 0)
+    {
+        Image encode_source = read_source_file(get_source_file_name(bench, kind, size, "_encode"));
+        for(Compression compression=0; compression<Compression_COUNT; ++compression)
+        {
+            if(stage.substr(7) != COMPRESSION_NAMES[compression]) continue;
+            run_bench(bench, name, CAST(f64, encode_source.width) * encode_source.height / 1e6, [&]()
+            {
+                PngImage encoded(encode_source, compression);
+                free_png_image(encoded);
+            });
+        }
+        free_image(encode_source);
+    }
+    else
+    {
+        // End to end runs of every platform driver, including decoding the input from disk and writing the output.
+        std::filesystem::path work = bench.work;
+        Options options;
+        options.input.push_back(input);
+        options.resize = true;
+        options.jobs = bench.jobs;
+        if(stage == "win32")
+        {
+            options.platform = Platform_Win32;
+            options.sizes = { 256, 128, 64, 48, 32, 16 };
+            options.output = (work / "icon.ico").string();
+        }
+        else if(stage == "android")
+        {
+            options.platform = Platform_Android;
+            options.sizes = { 256 };
+            options.output = (work / "android").string();
+        }
+        else
+        {
+            options.platform = Platform_iOS;
+            options.contents = (work / "Contents.json").string();
+            options.output = (work / "ios.appiconset").string();
+        }
+        run_bench(bench, name, megapixels, [&]() { make_icon(options); });
+    }
+}
+
+// Runs a benchmark by name, in the process that was started for it.
+static void run_named_bench(const BenchOptions& bench)
+{
+    std::vector<std::string> parts;
+    tokenize_string(bench.run, "/", parts);
+    if(parts.size() != 3)
+    {
+        ERROR("Unknown benchmark: %s", bench.run.c_str());
+    }
+    s32 size = std::stoi(parts[1]);
+    if(parts[0] == "filter")
+    {
+        run_filter_bench(bench, size, parts[2]);
+        return;
+    }
+    for(BenchSource kind=0; kind<BenchSource_COUNT; ++kind)
+    {
+        if(parts[0] == BENCH_SOURCE_NAMES[kind]) run_source_bench(bench, kind, size, parts[2]);
+    }
+}
+
+static void write_results(const std::vector<BenchResult>& results, FILE* file)
+{
+    // One result per line so that a stored run can be read back as a baseline without a JSON parser.
+    fprintf(file, "{\n");
+    fprintf(file, "  \"version\": \"%d.%d\",\n", MAKEICON_VERSION_MAJOR, MAKEICON_VERSION_MINOR);
+    fprintf(file, "  \"results\": [\n");
+    for(size_t i=0; i<results.size(); ++i)
+    {
+        const BenchResult& result = results[i];
+        fprintf(file, BENCH_RESULT_FORMAT, result.name.c_str(), result.seconds, result.mpix_per_s, result.peak_rss_mb);
+        fprintf(file, "%s\n", (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+}
+
+static std::vector<BenchResult> read_results(const std::string& file_name)
+{
+    std::ifstream file(file_name);
+    if(!file.is_open())
+    {
+        ERROR("Failed to read baseline file: %s", file_name.c_str());
+    }
+    std::vector<BenchResult> results;
+    std::string line;
+    while(getline(file, line))
+    {
+        BenchResult result;
+        if(parse_result(line, result))
+        {
+            results.push_back(result);
+        }
+    }
+    return results;
+}
+
+// Returns the number of results that are slower than the baseline by more than the threshold.
+static s32 compare_results(const std::vector<BenchResult>& results, const std::vector<BenchResult>& baseline, f64 threshold)
+{
+    s32 regressions = 0;
+    for(auto& result: results)
+    {
+        for(auto& base: baseline)
+        {
+            if(base.name != result.name) continue;
+            f64 change = (result.seconds - base.seconds) / base.seconds;
+            if(change > threshold)
+            {
+                WARNING("%s regressed by %.1f%% (%.3f ms -> %.3f ms)", result.name.c_str(), change * 100.0, base.seconds * 1000.0, result.seconds * 1000.0);
+                ++regressions;
+            }
+            break;
+        }
+    }
+    return regressions;
+}
+
+int main(int argc, char** argv)
+{
+    BenchOptions bench;
+    bench.program = argv[0];
+
+    for(s32 i=1; i<argc; ++i)
+    {
+        if(argv[i][0] == '-')
+        {
+            Argument arg = format_argument(argv[i]);
+            if(arg.name == "sizes")
+            {
+                bench.sizes.clear();
+                for(auto& param: arg.params)
+                {
+                    bench.sizes.push_back(std::stoi(param));
+                }
+            }
+            else if(arg.name == "sources")
+            {
+                for(auto& param: arg.params)
+                {
+                    BenchSource source = BenchSource_COUNT;
+                    for(BenchSource j=0; j<BenchSource_COUNT; ++j)
+                    {
+                        if(param == BENCH_SOURCE_NAMES[j]) source = j;
+                    }
+                    if(source == BenchSource_COUNT)
+                    {
+                        ERROR("Unknown source: %s", param.c_str());
+                    }
+                    bench.sources.push_back(source);
+                }
+            }
+            else if(arg.name == "iterations")
+            {
+                for(auto& param: arg.params) bench.iterations = std::max(1, std::stoi(param));
+            }
+            else if(arg.name == "jobs")
+            {
+                for(auto& param: arg.params) bench.jobs = std::stoi(param);
+            }
+            else if(arg.name == "baseline")
+            {
+                for(auto& param: arg.params) bench.baseline = param;
+            }
+            else if(arg.name == "threshold")
+            {
+                for(auto& param: arg.params) bench.threshold = std::stod(param);
+            }
+            else if(arg.name == "run")
+            {
+                for(auto& param: arg.params) bench.run = param;
+            }
+            else if(arg.name == "work")
+            {
+                // The path is taken whole, a colon in it would otherwise split it into parameters.
+                bench.work = std::string(argv[i]).substr(strlen("-work:"));
+            }
+            else if(arg.name == "help")
+            {
+                fprintf(stdout, "%s\n", MAKEICON_BENCH_HELP_MESSAGE);
+                return EXIT_SUCCESS;
+            }
+            else
+            {
+                ERROR("Unknown argument: %s", arg.name.c_str());
+            }
+        }
+        else
+        {
+            bench.output = argv[i];
+        }
+    }
+    if(bench.sources.empty())
+    {
+        for(BenchSource i=0; i<BenchSource_COUNT; ++i) bench.sources.push_back(i);
+    }
+
+    if(!bench.run.empty())
+    {
+        run_named_bench(bench);
+        return EXIT_SUCCESS;
+    }
+
+    std::filesystem::path work = std::filesystem::temp_directory_path() / ("makeicon_bench" + std::to_string(std::random_device()()));
+    std::filesystem::create_directories(work);
+    bench.work = work.string();
+    write_apple_contents((work / "Contents.json").string());
+
+    std::vector<BenchResult> results;
+    for(auto size: { 256, 1024 })
+    {
+        benchmark_filters(bench, size, results);
+    }
+    for(auto size: bench.sizes)
+    {
+        for(auto source: bench.sources)
+        {
+            prepare_source(bench, source, size);
+            for(auto stage: BENCH_STAGES)
+            {
+                spawn_bench(bench, std::string(BENCH_SOURCE_NAMES[source]) + "/" + std::to_string(size) + "/" + stage, results);
+            }
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::remove_all(work, error);
+
+    FILE* output = stdout;
+    if(!bench.output.empty())
+    {
+        output = fopen(bench.output.c_str(), "w");
+        if(!output)
+        {
+            ERROR("Failed to save output file: %s", bench.output.c_str());
+        }
+    }
+    write_results(results, output);
+    if(output != stdout)
+    {
+        fclose(output);
+    }
+
+    if(!bench.baseline.empty())
+    {
+        s32 regressions = compare_results(results, read_results(bench.baseline), bench.threshold);
+        if(regressions > 0)
+        {
+            fprintf(stderr, "[makeicon] %d benchmark(s) regressed against %s\n", regressions, bench.baseline.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}